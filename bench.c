@@ -0,0 +1,283 @@
+// Drives an SDLuxer server with synthetic clients and reports how it did.
+//
+// Each client sets a double-buffered (or, with -3, mailbox) video mode and
+// then draws frames as fast as it's allowed to, or at -f frames per second.
+// We report frames per second and latency from Draw to the server's reply
+// (Flipped, or NextBuffer in mailbox mode), overall and for each client,
+// and CPU time used.  Flipped also says when the frame went on the screen,
+// which gives the latency from Draw to the screen (present_latency).
+//
+// With -x, the server is started (headless) on a temporary socket, and its
+// CPU use is reported too (-j is passed on to it).  Otherwise we connect to
+// -c, $SDLUXER_SERVER or ./sdluxersock.
+//
+// Usage: sdluxer_bench [-x server] [-c socket] [-n clients] [-t seconds]
+//                      [-f fps] [-d WxH] [-3] [-j threads]
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "sdlux_client.h"
+#include "stats.h"
+
+typedef struct
+{
+  SdluxClient c;
+  uint64_t sent_at; // When we sent the Draw we're waiting on (us), or 0
+  uint64_t next_draw; // When we're allowed to draw next (us)
+  uint64_t frames;
+  Histogram latency;
+  uint32_t seed;
+} BenchClient;
+
+static const char * server_path = NULL;
+static const char * sock_path = NULL;
+static int num_clients = 4;
+static int seconds = 10;
+static int fps = 0; // 0 means as fast as possible
+static int width = 320, height = 240;
+static bool mailbox = false;
+static const char * server_threads = NULL; // Passed to the server as -j
+
+static pid_t server_pid = -1;
+static char tmp_sock[108];
+
+// Server CPU time in clock ticks, from /proc
+static long long server_cpu (void)
+{
+  if (server_pid < 0) return -1;
+  char fn[64];
+  snprintf(fn, sizeof(fn), "/proc/%i/stat", (int)server_pid);
+  FILE * f = fopen(fn, "r");
+  if (!f) return -1;
+  char buf[1024];
+  size_t n = fread(buf, 1, sizeof(buf)-1, f);
+  fclose(f);
+  buf[n] = 0;
+  // The command name is in parens and can contain spaces, so skip past it
+  char * p = strrchr(buf, ')');
+  if (!p) return -1;
+  unsigned long long utime, stime;
+  if (sscanf(p + 2, "%*c %*d %*d %*d %*d %*d %*u %*u %*u %*u %*u %llu %llu", &utime, &stime) != 2) return -1;
+  return utime + stime;
+}
+
+static void start_server (void)
+{
+  snprintf(tmp_sock, sizeof(tmp_sock), "/tmp/sdluxer_bench_%i", (int)getpid());
+  unlink(tmp_sock);
+  server_pid = fork();
+  if (server_pid == 0)
+  {
+    char dims[32];
+    snprintf(dims, sizeof(dims), "-d%ix%i", width * 2 > 1024 ? width * 2 : 1024, height * 2 > 768 ? height * 2 : 768);
+    char threads[32];
+    snprintf(threads, sizeof(threads), "-j%s", server_threads ? server_threads : "1");
+    execl(server_path, server_path, "-H", "-n", tmp_sock, dims, threads, (char*)NULL);
+    perror("exec");
+    _exit(1);
+  }
+  sock_path = tmp_sock;
+}
+
+static void stop_server (void)
+{
+  if (server_pid < 0) return;
+  kill(server_pid, SIGINT);
+  waitpid(server_pid, NULL, 0);
+  server_pid = -1;
+}
+
+static bool connect_client (BenchClient * b)
+{
+  // If we just started the server, give it a moment to come up
+  for (int tries = 0; tries < 50; tries++)
+  {
+    if (sdlux_connect(&b->c, sock_path)) return true;
+    if (server_pid < 0) return false;
+    usleep(100000);
+  }
+  return false;
+}
+
+static void draw_frame (BenchClient * b)
+{
+  // Scribble on a band of the buffer so there's real memory traffic
+  uint32_t * p = sdlux_back_buffer(&b->c);
+  int rows = b->c.h / 8;
+  int start = (b->frames * rows) % b->c.h;
+  for (int y = start; y < start + rows && y < b->c.h; y++)
+  {
+    uint32_t * row = (uint32_t *)((char *)p + y * b->c.pitch);
+    for (int x = 0; x < b->c.w; x++) row[x] = (b->seed += 0x9e3779b9);
+  }
+}
+
+int main (int argc, char * argv[])
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "x:c:n:t:f:d:3j:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'x': server_path = optarg; break;
+      case 'c': sock_path = optarg; break;
+      case 'n': num_clients = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 'f': fps = atoi(optarg); break;
+      case 'd': sscanf(optarg, "%ix%i", &width, &height); break;
+      case '3': mailbox = true; break;
+      case 'j': server_threads = optarg; break;
+      default:
+        fprintf(stderr, "Usage: %s [-x server] [-c socket] [-n clients] [-t seconds] [-f fps] [-d WxH] [-3] [-j threads]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (num_clients < 1) num_clients = 1;
+  if (!sock_path) sock_path = getenv("SDLUXER_SERVER");
+  if (!sock_path) sock_path = "sdluxersock";
+  if (server_path) start_server();
+
+  BenchClient * clients = calloc(num_clients, sizeof(BenchClient));
+  struct pollfd * pfds = calloc(num_clients, sizeof(struct pollfd));
+  for (int i = 0; i < num_clients; i++)
+  {
+    BenchClient * b = &clients[i];
+    b->seed = i + 1;
+    if (!connect_client(b))
+    {
+      fprintf(stderr, "Couldn't connect to %s\n", sock_path);
+      stop_server();
+      return 1;
+    }
+    if (!sdlux_set_video_mode(&b->c, width, height, 32, true, mailbox ? 3 : 2) || b->c.depth != 32)
+    {
+      fprintf(stderr, "Couldn't set video mode\n");
+      stop_server();
+      return 1;
+    }
+    pfds[i].fd = b->c.fd;
+    pfds[i].events = POLLIN;
+  }
+
+  struct rusage ru0, ru1;
+  getrusage(RUSAGE_SELF, &ru0);
+  long long server0 = server_cpu();
+  uint64_t start = stats_now_us();
+  uint64_t end = start + (uint64_t)seconds * 1000000;
+  uint64_t interval = fps ? 1000000 / fps : 0;
+  Histogram all = {};
+  Histogram present = {};
+  static char buf[4096];
+
+  uint64_t now;
+  while ((now = stats_now_us()) < end)
+  {
+    int timeout = 100;
+    for (int i = 0; i < num_clients; i++)
+    {
+      BenchClient * b = &clients[i];
+      if (b->sent_at) continue;
+      if (now < b->next_draw)
+      {
+        int ms = (b->next_draw - now) / 1000;
+        if (ms < timeout) timeout = ms;
+        continue;
+      }
+      draw_frame(b);
+      b->sent_at = now;
+      b->next_draw = now + interval;
+      if (!sdlux_draw(&b->c, true))
+      {
+        fprintf(stderr, "Client %i lost its connection\n", i);
+        stop_server();
+        return 1;
+      }
+      timeout = 0;
+    }
+
+    if (poll(pfds, num_clients, timeout) < 0 && errno != EINTR) break;
+
+    for (int i = 0; i < num_clients; i++)
+    {
+      if (!(pfds[i].revents & POLLIN)) continue;
+      BenchClient * b = &clients[i];
+      int r;
+      while ((r = sdlux_recv(&b->c, buf, sizeof(buf), false)) > 0)
+      {
+        int32_t type = *(int32_t*)buf;
+        if ((type == Flipped || type == NextBuffer) && b->sent_at)
+        {
+          if (type == Flipped && b->c.flipped.present_time >= b->sent_at)
+          {
+            hist_add(&present, b->c.flipped.present_time - b->sent_at);
+          }
+          uint64_t lat = stats_now_us() - b->sent_at;
+          hist_add(&b->latency, lat);
+          hist_add(&all, lat);
+          b->sent_at = 0;
+          b->frames++;
+        }
+      }
+      if (r < 0)
+      {
+        fprintf(stderr, "Client %i lost its connection\n", i);
+        stop_server();
+        return 1;
+      }
+    }
+  }
+
+  double elapsed = (stats_now_us() - start) / 1000000.0;
+  getrusage(RUSAGE_SELF, &ru1);
+  long long server1 = server_cpu();
+
+  uint64_t frames = 0;
+  for (int i = 0; i < num_clients; i++) frames += clients[i].frames;
+
+  printf("clients %i\n", num_clients);
+  printf("size %ix%i\n", width, height);
+  printf("mode %s\n", mailbox ? "mailbox" : "double");
+  printf("seconds %.3f\n", elapsed);
+  printf("frames %llu\n", (unsigned long long)frames);
+  printf("fps_total %.1f\n", frames / elapsed);
+  printf("fps_per_client %.1f\n", frames / elapsed / num_clients);
+  printf("latency_us_p50 %llu\n", (unsigned long long)hist_percentile(&all, 50));
+  printf("latency_us_p99 %llu\n", (unsigned long long)hist_percentile(&all, 99));
+  printf("latency_us_max %llu\n", (unsigned long long)all.max);
+  if (present.count)
+  {
+    printf("present_latency_us_p50 %llu\n", (unsigned long long)hist_percentile(&present, 50));
+    printf("present_latency_us_p99 %llu\n", (unsigned long long)hist_percentile(&present, 99));
+  }
+
+  for (int i = 0; i < num_clients; i++)
+  {
+    BenchClient * b = &clients[i];
+    printf("client%i_fps %.1f\n", i, b->frames / elapsed);
+    printf("client%i_latency_us_p50 %llu\n", i, (unsigned long long)hist_percentile(&b->latency, 50));
+    printf("client%i_latency_us_p99 %llu\n", i, (unsigned long long)hist_percentile(&b->latency, 99));
+  }
+
+  double bench_cpu = (ru1.ru_utime.tv_sec - ru0.ru_utime.tv_sec) + (ru1.ru_stime.tv_sec - ru0.ru_stime.tv_sec)
+                   + ((ru1.ru_utime.tv_usec - ru0.ru_utime.tv_usec) + (ru1.ru_stime.tv_usec - ru0.ru_stime.tv_usec)) / 1000000.0;
+  printf("client_cpu_pct_per_client %.2f\n", 100.0 * bench_cpu / elapsed / num_clients);
+  if (server0 >= 0 && server1 >= 0)
+  {
+    double server_secs = (double)(server1 - server0) / sysconf(_SC_CLK_TCK);
+    printf("server_cpu_pct %.2f\n", 100.0 * server_secs / elapsed);
+    printf("server_cpu_pct_per_client %.2f\n", 100.0 * server_secs / elapsed / num_clients);
+  }
+
+  for (int i = 0; i < num_clients; i++) sdlux_close(&clients[i].c);
+  stop_server();
+  return 0;
+}
@@ -0,0 +1,150 @@
+// Compares blit_fast() with SDL_BlitSurface() for the kinds of copies
+// SDLuxer does when drawing client windows, and times making thumbnails.
+//
+// With threads, big blits are split across that many threads, as with
+// sdluxer -j.
+//
+// Usage: sdluxer_blitbench [iterations [threads]]
+
+#define _GNU_SOURCE
+#include <SDL/SDL.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#include "blit.h"
+#include "workpool.h"
+
+static double now_ms (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000.0 + ts.tv_nsec / 1000000.0;
+}
+
+static SDL_Surface * make_surface (int w, int h, int depth)
+{
+  SDL_Surface * s;
+  if (depth == 16)
+    s = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, 16, 0xf800, 0x07e0, 0x001f, 0);
+  else if (depth == 8)
+    s = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, 8, 0, 0, 0, 0);
+  else
+    s = SDL_CreateRGBSurface(SDL_SWSURFACE, w, h, 32, 0xff0000, 0x00ff00, 0x0000ff, 0);
+  if (!s)
+  {
+    fprintf(stderr, "Couldn't create %ix%i surface\n", w, h);
+    exit(1);
+  }
+
+  if (depth == 8)
+  {
+    SDL_Color colors[256];
+    for (int i = 0; i < 256; i++)
+    {
+      colors[i].r = i;
+      colors[i].g = 255 - i;
+      colors[i].b = i * 7;
+    }
+    SDL_SetColors(s, colors, 0, 256);
+  }
+
+  int bpp = depth / 8;
+  for (int y = 0; y < h; y++)
+  {
+    Uint8 * row = (Uint8 *)s->pixels + y * s->pitch;
+    for (int x = 0; x < w * bpp; x++) row[x] = (x * 2654435761u + y) >> 24;
+  }
+  return s;
+}
+
+static void run (const char * name, int depth, int sw, int sh, int dw, int dh, SDL_Rect sr, SDL_Rect dr, int iterations)
+{
+  SDL_Surface * src = make_surface(sw, sh, depth);
+  SDL_Surface * dst = make_surface(dw, dh, 32);
+
+  double t0 = now_ms();
+  for (int i = 0; i < iterations; i++)
+  {
+    SDL_Rect s = sr, d = dr;
+    SDL_BlitSurface(src, &s, dst, &d);
+  }
+  double sdl = now_ms() - t0;
+
+  t0 = now_ms();
+  int fast = 0;
+  for (int i = 0; i < iterations; i++)
+  {
+    if (depth == 32 ? blit_fast(src, &sr, dst, &dr) : blit_convert(src, &sr, dst, &dr)) fast++;
+  }
+  double mine = now_ms() - t0;
+
+  double mb = (double)sr.w * sr.h * (depth / 8) * iterations / (1024.0 * 1024.0);
+  printf("%-24s  SDL %8.3f ms/blit %8.1f MB/s   fast %8.3f ms/blit %8.1f MB/s   %5.2fx%s\n",
+         name,
+         sdl / iterations, mb / (sdl / 1000.0),
+         mine / iterations, mb / (mine / 1000.0),
+         sdl / mine,
+         fast == iterations ? "" : "  (fast path not taken!)");
+
+  SDL_FreeSurface(src);
+  SDL_FreeSurface(dst);
+}
+
+// Shrinking a whole window to a thumbnail, as the window switcher does
+static void run_shrink (const char * name, int w, int h, int factor, int iterations)
+{
+  SDL_Surface * src = make_surface(w, h, 32);
+  SDL_Surface * dst = make_surface(w / factor, h / factor, 32);
+
+  double t0 = now_ms();
+  for (int i = 0; i < iterations; i++)
+  {
+    blit_shrink(dst->pixels, dst->pitch, src->pixels, src->pitch, w, h, factor);
+  }
+  double ms = now_ms() - t0;
+
+  double mb = (double)w * h * 4 * iterations / (1024.0 * 1024.0);
+  printf("%-24s  %8.3f ms/shrink %8.1f MB/s\n", name, ms / iterations, mb / (ms / 1000.0));
+
+  SDL_FreeSurface(src);
+  SDL_FreeSurface(dst);
+}
+
+int main (int argc, char * argv[])
+{
+  int iterations = 200;
+  if (argc > 1) iterations = atoi(argv[1]);
+  if (iterations < 1) iterations = 1;
+  if (argc > 2 && !workpool_start(atoi(argv[2])))
+  {
+    fprintf(stderr, "Couldn't start threads\n");
+    return 1;
+  }
+
+  // Whole window onto a larger screen
+  run("640x480 window", 32, 640, 480, 1280, 1024,
+      (SDL_Rect){0, 0, 640, 480}, (SDL_Rect){100, 100, 0, 0}, iterations);
+  run("1920x1080 window", 32, 1920, 1080, 1920, 1080,
+      (SDL_Rect){0, 0, 1920, 1080}, (SDL_Rect){0, 0, 0, 0}, iterations);
+
+  // A fullscreen client, where the rows are contiguous in both surfaces
+  run("1280x1024 fullscreen", 32, 1280, 1024, 1280, 1024,
+      (SDL_Rect){0, 0, 1280, 1024}, (SDL_Rect){0, 0, 0, 0}, iterations);
+
+  // A terminal-sized damage rectangle
+  run("80x16 damage", 32, 640, 480, 1280, 1024,
+      (SDL_Rect){160, 240, 80, 16}, (SDL_Rect){260, 340, 0, 0}, iterations * 100);
+
+  // Old games in 8 and 16 bit modes
+  run("640x480 8bpp window", 8, 640, 480, 1280, 1024,
+      (SDL_Rect){0, 0, 640, 480}, (SDL_Rect){100, 100, 0, 0}, iterations);
+  run("640x480 565 window", 16, 640, 480, 1280, 1024,
+      (SDL_Rect){0, 0, 640, 480}, (SDL_Rect){100, 100, 0, 0}, iterations);
+
+  // Window switcher thumbnails
+  run_shrink("640x480 thumbnail", 640, 480, 4, iterations);
+  run_shrink("1920x1080 thumbnail", 1920, 1080, 12, iterations);
+
+  return 0;
+}
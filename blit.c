@@ -0,0 +1,324 @@
+#include "blit.h"
+#include "workpool.h"
+#include <string.h>
+
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+static bool same_format (const SDL_PixelFormat * a, const SDL_PixelFormat * b)
+{
+  if (a->BitsPerPixel != b->BitsPerPixel) return false;
+  if (a->BytesPerPixel != b->BytesPerPixel) return false;
+  if (a->palette || b->palette) return false;
+  return a->Rmask == b->Rmask && a->Gmask == b->Gmask && a->Bmask == b->Bmask;
+}
+
+// The actual copy.  glibc's memcpy() already picks the best vector
+// implementation for the CPU, so there's no point in us doing our own.
+// What we can do is notice when rows are contiguous in both surfaces (e.g.,
+// a full-width update) and do it as one big copy.
+static void copy_rows (char * dst, int dpitch, const char * src, int spitch, int row_bytes, int rows)
+{
+  if (dpitch == row_bytes && spitch == row_bytes)
+  {
+    memcpy(dst, src, (size_t)row_bytes * rows);
+    return;
+  }
+
+  while (rows--)
+  {
+    memcpy(dst, src, row_bytes);
+    dst += dpitch;
+    src += spitch;
+  }
+}
+
+static bool rect_inside (SDL_Surface * src, const SDL_Rect * sr, SDL_Surface * dst, const SDL_Rect * dr)
+{
+  // Must be entirely inside the source...
+  if (sr->x < 0 || sr->y < 0) return false;
+  if (sr->x + sr->w > src->w || sr->y + sr->h > src->h) return false;
+
+  // ...and entirely inside the destination's clip rect
+  const SDL_Rect * c = &dst->clip_rect;
+  if (dr->x < c->x || dr->y < c->y) return false;
+  if (dr->x + sr->w > c->x + c->w || dr->y + sr->h > c->y + c->h) return false;
+
+  return true;
+}
+
+// A palette lookup is a gather, which SSE2 can't do, so this is just
+// unrolled to give the CPU several independent loads at once.
+static void convert_8 (Uint32 * dst, const Uint8 * src, int w, const Uint32 * lut)
+{
+  int x = 0;
+  for (; x + 4 <= w; x += 4)
+  {
+    Uint32 a = lut[src[x+0]];
+    Uint32 b = lut[src[x+1]];
+    Uint32 c = lut[src[x+2]];
+    Uint32 d = lut[src[x+3]];
+    dst[x+0] = a;
+    dst[x+1] = b;
+    dst[x+2] = c;
+    dst[x+3] = d;
+  }
+  for (; x < w; x++) dst[x] = lut[src[x]];
+}
+
+// Expands 5 or 6 bit components to 8 bits by replicating the top bits into
+// the bottom, so that full intensity stays full intensity.
+#define EXPAND5(v) (((v) << 3) | ((v) >> 2))
+#define EXPAND6(v) (((v) << 2) | ((v) >> 4))
+
+static void convert_565 (Uint32 * dst, const Uint16 * src, int w, const SDL_PixelFormat * f)
+{
+  int x = 0;
+#ifdef __SSE2__
+  // Eight pixels at a time, but only for the usual 0x00RRGGBB layout
+  if (f->Rshift == 16 && f->Gshift == 8 && f->Bshift == 0)
+  {
+    const __m128i m5 = _mm_set1_epi16(0x1f);
+    const __m128i m6 = _mm_set1_epi16(0x3f);
+    for (; x + 8 <= w; x += 8)
+    {
+      __m128i p = _mm_loadu_si128((const __m128i *)(src + x));
+      __m128i r = _mm_srli_epi16(p, 11);
+      __m128i g = _mm_and_si128(_mm_srli_epi16(p, 5), m6);
+      __m128i b = _mm_and_si128(p, m5);
+      r = _mm_or_si128(_mm_slli_epi16(r, 3), _mm_srli_epi16(r, 2));
+      g = _mm_or_si128(_mm_slli_epi16(g, 2), _mm_srli_epi16(g, 4));
+      b = _mm_or_si128(_mm_slli_epi16(b, 3), _mm_srli_epi16(b, 2));
+      // Interleaving (G<<8|B) with R gives R<<16|G<<8|B in each 32 bit lane
+      __m128i gb = _mm_or_si128(_mm_slli_epi16(g, 8), b);
+      _mm_storeu_si128((__m128i *)(dst + x), _mm_unpacklo_epi16(gb, r));
+      _mm_storeu_si128((__m128i *)(dst + x + 4), _mm_unpackhi_epi16(gb, r));
+    }
+  }
+#endif
+  for (; x < w; x++)
+  {
+    Uint32 p = src[x];
+    Uint32 r = p >> 11;
+    Uint32 g = (p >> 5) & 0x3f;
+    Uint32 b = p & 0x1f;
+    dst[x] = (EXPAND5(r) << f->Rshift) | (EXPAND6(g) << f->Gshift) | (EXPAND5(b) << f->Bshift);
+  }
+}
+
+// Big blits are split into bands of rows, one per thread in the work pool.
+// Small ones aren't worth waking the pool for.
+#define BLIT_PARALLEL_MIN (256*1024) // Bytes written
+
+typedef enum { RowsCopy, RowsConvert8, RowsConvert565 } RowKind;
+
+typedef struct
+{
+  RowKind kind;
+  char * dp;
+  int dpitch;
+  const char * sp;
+  int spitch;
+  int w; // In pixels
+  int row_bytes; // Written per row
+  int rows;
+  const Uint32 * lut; // For RowsConvert8
+  const SDL_PixelFormat * df; // For RowsConvert565
+} RowJob;
+
+static void do_rows (const RowJob * j, int first, int count)
+{
+  char * dp = j->dp + (size_t)first * j->dpitch;
+  const char * sp = j->sp + (size_t)first * j->spitch;
+  if (j->kind == RowsCopy)
+  {
+    copy_rows(dp, j->dpitch, sp, j->spitch, j->row_bytes, count);
+    return;
+  }
+  while (count--)
+  {
+    if (j->kind == RowsConvert8) convert_8((Uint32 *)dp, (const Uint8 *)sp, j->w, j->lut);
+    else convert_565((Uint32 *)dp, (const Uint16 *)sp, j->w, j->df);
+    dp += j->dpitch;
+    sp += j->spitch;
+  }
+}
+
+static void row_band (void * arg, int part, int parts)
+{
+  const RowJob * j = arg;
+  int first = (long long)j->rows * part / parts;
+  int end = (long long)j->rows * (part + 1) / parts;
+  do_rows(j, first, end - first);
+}
+
+static void run_rows (const RowJob * j)
+{
+  int parts = workpool_threads();
+  if (parts > 1 && (size_t)j->row_bytes * j->rows >= BLIT_PARALLEL_MIN)
+  {
+    workpool_run(row_band, (void *)j, parts);
+  }
+  else
+  {
+    do_rows(j, 0, j->rows);
+  }
+}
+
+bool blit_fast (SDL_Surface * src, const SDL_Rect * sr, SDL_Surface * dst, const SDL_Rect * dr)
+{
+  if (src->flags & (SDL_SRCCOLORKEY | SDL_SRCALPHA)) return false;
+  if (!same_format(src->format, dst->format)) return false;
+
+  if (sr->w == 0 || sr->h == 0) return true;
+  if (!rect_inside(src, sr, dst, dr)) return false;
+
+  bool locked = false;
+  if (SDL_MUSTLOCK(dst))
+  {
+    if (SDL_LockSurface(dst) != 0) return false;
+    locked = true;
+  }
+
+  int bpp = dst->format->BytesPerPixel;
+  RowJob j = {RowsCopy};
+  j.dp = (char *)dst->pixels + dr->y * dst->pitch + dr->x * bpp;
+  j.dpitch = dst->pitch;
+  j.sp = (const char *)src->pixels + sr->y * src->pitch + sr->x * bpp;
+  j.spitch = src->pitch;
+  j.w = sr->w;
+  j.row_bytes = sr->w * bpp;
+  j.rows = sr->h;
+  run_rows(&j);
+
+  if (locked) SDL_UnlockSurface(dst);
+  return true;
+}
+
+static bool is_565 (const SDL_PixelFormat * f)
+{
+  return f->BitsPerPixel == 16 && f->Rmask == 0xf800 && f->Gmask == 0x07e0 && f->Bmask == 0x001f;
+}
+
+bool blit_convert (SDL_Surface * src, const SDL_Rect * sr, SDL_Surface * dst, const SDL_Rect * dr)
+{
+  const SDL_PixelFormat * sf = src->format;
+  const SDL_PixelFormat * df = dst->format;
+  if (src->flags & (SDL_SRCCOLORKEY | SDL_SRCALPHA)) return false;
+  if (df->BitsPerPixel != 32 || df->palette) return false;
+  bool paletted = sf->BitsPerPixel == 8 && sf->palette;
+  if (!paletted && !is_565(sf)) return false;
+
+  if (sr->w == 0 || sr->h == 0) return true;
+  if (!rect_inside(src, sr, dst, dr)) return false;
+
+  // Rebuilding this every time is cheap next to converting even a small
+  // rectangle, and means we never have a stale palette.
+  Uint32 lut[256];
+  if (paletted)
+  {
+    int n = sf->palette->ncolors;
+    if (n > 256) n = 256;
+    for (int i = 0; i < n; i++)
+    {
+      SDL_Color * c = &sf->palette->colors[i];
+      lut[i] = SDL_MapRGB(df, c->r, c->g, c->b);
+    }
+    for (int i = n; i < 256; i++) lut[i] = 0;
+  }
+
+  bool locked = false;
+  if (SDL_MUSTLOCK(dst))
+  {
+    if (SDL_LockSurface(dst) != 0) return false;
+    locked = true;
+  }
+
+  RowJob j = {paletted ? RowsConvert8 : RowsConvert565};
+  j.dp = (char *)dst->pixels + dr->y * dst->pitch + dr->x * 4;
+  j.dpitch = dst->pitch;
+  j.sp = (const char *)src->pixels + sr->y * src->pitch + sr->x * sf->BytesPerPixel;
+  j.spitch = src->pitch;
+  j.w = sr->w;
+  j.row_bytes = sr->w * 4;
+  j.rows = sr->h;
+  j.lut = lut;
+  j.df = df;
+  run_rows(&j);
+
+  if (locked) SDL_UnlockSurface(dst);
+  return true;
+}
+
+bool blit_rect (SDL_Surface * src, const SDL_Rect * sr, SDL_Surface * dst, const SDL_Rect * dr)
+{
+  if (blit_fast(src, sr, dst, dr)) return true;
+  if (blit_convert(src, sr, dst, dr)) return true;
+  SDL_Rect s = *sr;
+  SDL_Rect d = *dr;
+  SDL_BlitSurface(src, &s, dst, &d);
+  return false;
+}
+
+// Averages one factor x factor box.  With SSE2, we widen each pixel's bytes
+// to 16 bits and sum several pixels at once, then fold each row's sums
+// into 32 bit totals.  (A row of up to 64 pixels is spread over two sets
+// of lanes, so the 16 bit sums can't overflow.)
+static Uint32 shrink_box (const char * src, int spitch, int factor)
+{
+  Uint32 sums[4] = {0, 0, 0, 0};
+#ifdef __SSE2__
+  const __m128i zero = _mm_setzero_si128();
+  __m128i acc = zero;
+  for (int y = 0; y < factor; y++)
+  {
+    const Uint32 * row = (const Uint32 *)(src + y * spitch);
+    __m128i racc = zero;
+    int x = 0;
+    for (; x + 4 <= factor; x += 4)
+    {
+      __m128i p = _mm_loadu_si128((const __m128i *)(row + x));
+      racc = _mm_add_epi16(racc, _mm_unpacklo_epi8(p, zero));
+      racc = _mm_add_epi16(racc, _mm_unpackhi_epi8(p, zero));
+    }
+    for (; x < factor; x++)
+    {
+      racc = _mm_add_epi16(racc, _mm_unpacklo_epi8(_mm_cvtsi32_si128(row[x]), zero));
+    }
+    racc = _mm_add_epi16(racc, _mm_srli_si128(racc, 8));
+    acc = _mm_add_epi32(acc, _mm_unpacklo_epi16(racc, zero));
+  }
+  _mm_storeu_si128((__m128i *)sums, acc);
+#else
+  for (int y = 0; y < factor; y++)
+  {
+    const Uint8 * row = (const Uint8 *)(src + y * spitch);
+    for (int x = 0; x < factor * 4; x += 4)
+    {
+      sums[0] += row[x+0];
+      sums[1] += row[x+1];
+      sums[2] += row[x+2];
+      sums[3] += row[x+3];
+    }
+  }
+#endif
+  // Byte order in memory, so this is right whatever the endianness
+  Uint32 n = factor * factor;
+  Uint32 out;
+  Uint8 * o = (Uint8 *)&out;
+  for (int i = 0; i < 4; i++) o[i] = (sums[i] + n / 2) / n;
+  return out;
+}
+
+void blit_shrink (Uint32 * dst, int dpitch, const Uint32 * src, int spitch, int w, int h, int factor)
+{
+  int ow = w / factor;
+  int oh = h / factor;
+  for (int y = 0; y < oh; y++)
+  {
+    const char * srow = (const char *)src + (size_t)y * factor * spitch;
+    Uint32 * drow = (Uint32 *)((char *)dst + (size_t)y * dpitch);
+    for (int x = 0; x < ow; x++) drow[x] = shrink_box(srow + (size_t)x * factor * 4, spitch, factor);
+  }
+}
@@ -0,0 +1,31 @@
+#ifndef SDLUXER_BLIT_H
+#define SDLUXER_BLIT_H
+
+#include <SDL/SDL.h>
+#include <stdbool.h>
+
+// Big copies and conversions are split across the work pool (see
+// workpool.h), if there is one.
+
+// Copies sr from src to dr on dst (only dr's x and y are used) without
+// going through SDL_BlitSurface().  This only works when the two surfaces
+// have the same pixel format and the whole rectangle is inside both the
+// source and dst's clip rectangle; returns false (having done nothing)
+// otherwise.
+bool blit_fast (SDL_Surface * src, const SDL_Rect * sr, SDL_Surface * dst, const SDL_Rect * dr);
+
+// Like blit_fast(), but for an 8 bit paletted or 16 bit RGB565 source and a
+// 32 bit destination.  Same restrictions on the rectangle.
+bool blit_convert (SDL_Surface * src, const SDL_Rect * sr, SDL_Surface * dst, const SDL_Rect * dr);
+
+// Tries blit_fast() and blit_convert(), and falls back to
+// SDL_BlitSurface().  Returns true if one of ours was used.
+bool blit_rect (SDL_Surface * src, const SDL_Rect * sr, SDL_Surface * dst, const SDL_Rect * dr);
+
+// Shrinks w x h 32 bit pixels at src to (w/factor) x (h/factor) at dst by
+// averaging each factor x factor box.  Each byte of a pixel is averaged on
+// its own, so it works for any 32 bit layout.  Pitches are in bytes, and
+// factor must be from 1 to 64.
+void blit_shrink (Uint32 * dst, int dpitch, const Uint32 * src, int spitch, int w, int h, int factor);
+
+#endif
@@ -0,0 +1,103 @@
+#include "framesched.h"
+
+void sched_init (FrameSched * fs, int rate, bool immediate)
+{
+  memset(fs, 0, sizeof(*fs));
+  if (rate < 1) rate = 1;
+  if (rate > 1000) rate = 1000;
+  fs->rate = rate;
+  fs->immediate = immediate;
+  fs->start_time = fs->last_time = fs->target_time = SDL_GetTicks();
+  fs->interval = 1000 / rate;
+}
+
+// How long to wait between idle checks when we can't sleep
+static int idle_interval (FrameSched * fs)
+{
+  int n = fs->idle_count;
+  if (n > (60*10+30*60+10*120))
+  {
+    // We've been idle for 3m10s -- cut rate down to 5 fps
+    return 200;
+  }
+  else if (n > (60*10+30*60))
+  {
+    // We've been idle for 70 seconds -- cut rate down to 10 fps
+    return 100;
+  }
+  else if (n > 60*10)
+  {
+    // Been idle for 10 seconds -- cut rate down to 30 fps
+    return 33;
+  }
+  return 17;
+}
+
+bool sched_poll (FrameSched * fs, bool draw_pending, int * timeout)
+{
+  Uint32 now = SDL_GetTicks();
+  if (now < fs->last_time)
+  {
+    // Wrapped.  Resync.
+    fs->start_time = now;
+    fs->target_time = now;
+    fs->last_frame = now;
+  }
+  fs->last_time = now;
+
+  if (draw_pending)
+  {
+    int delta;
+    if (fs->immediate) delta = (int)(fs->last_frame + 1000 / fs->rate - now);
+    else delta = (int)(fs->target_time - now);
+    if (fs->idle_count) delta = 0; // First frame after being idle
+    if (delta <= 0) return true;
+    *timeout = delta;
+    return false;
+  }
+
+  // Nothing to draw, so wait out the rest of this frame in case something
+  // turns up...
+  int delta = fs->target_time - now;
+  if (delta > 0)
+  {
+    *timeout = delta;
+    return false;
+  }
+
+  // ...and after that, we're idle.
+  fs->idle_count++;
+  if (fs->can_sleep)
+  {
+    fs->interval = 0;
+    *timeout = -1;
+    return false;
+  }
+
+  fs->interval = idle_interval(fs);
+  fs->target_time = now + fs->interval;
+  *timeout = fs->interval;
+  return false;
+}
+
+void sched_frame_done (FrameSched * fs)
+{
+  Uint32 now = SDL_GetTicks();
+  if (fs->idle_count)
+  {
+    // Start a new grid
+    fs->start_time = now;
+    fs->num_frames = 0;
+  }
+  fs->idle_count = 0;
+  fs->last_frame = now;
+  fs->interval = 1000 / fs->rate;
+  ++fs->num_frames;
+  fs->target_time = fs->num_frames * 1000 / fs->rate + fs->start_time;
+}
+
+int sched_interval_us (const FrameSched * fs)
+{
+  if (!fs->idle_count) return 1000000 / fs->rate;
+  return fs->interval * 1000;
+}
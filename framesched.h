@@ -0,0 +1,51 @@
+#ifndef SDLUXER_FRAMESCHED_H
+#define SDLUXER_FRAMESCHED_H
+
+#include <SDL/SDL.h>
+#include <stdbool.h>
+#include <stdint.h>
+
+// Decides when the main loop should draw a frame and how long it should
+// sleep otherwise.
+//
+// Normally frames are paced on a fixed grid at the target rate, starting
+// from the first frame after an idle period.  In immediate mode, a frame is
+// drawn as soon as there's something to draw, provided the last one was at
+// least one frame interval ago; this gives the lowest latency from a
+// client's Draw to the screen.
+//
+// When there's nothing to draw, we only need to wake up to look for input.
+// If the main loop can wait on the input itself (can_sleep), we don't wake
+// up at all.  Otherwise we check at a rate which goes down the longer we've
+// been idle.
+
+typedef struct FrameSched
+{
+  int rate; // Target frames per second
+  bool immediate;
+  bool can_sleep;
+
+  Uint32 start_time; // Start of the current grid
+  Uint32 last_time; // For noticing SDL_GetTicks() wrapping
+  Uint32 target_time; // When the next frame (or idle check) is due
+  Uint32 last_frame; // When we last drew
+  uint64_t num_frames; // Since start_time; will wrap, but not any time soon
+  int idle_count; // Number of idle checks in a row
+  int interval; // Current time between frames (or idle checks) in ms
+} FrameSched;
+
+void sched_init (FrameSched * fs, int rate, bool immediate);
+
+// Returns true if a frame should be drawn now.  Otherwise, sets *timeout to
+// how many ms to wait for something to happen (-1 for forever).
+bool sched_poll (FrameSched * fs, bool draw_pending, int * timeout);
+
+// Call after drawing a frame
+void sched_frame_done (FrameSched * fs);
+
+// Time between frames right now, in us: the target rate's interval while
+// we're drawing, or between idle checks (0 if we sleep until there's input)
+// while we're not
+int sched_interval_us (const FrameSched * fs);
+
+#endif
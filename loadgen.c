@@ -0,0 +1,476 @@
+// Throws a lot of (sometimes deliberately bad) traffic at an SDLuxer server.
+//
+// Each session plays one of these roles:
+//   d - draws frames with random damage rects and keeps changing video mode
+//       (size, depth and number of buffers); half of them are told about
+//       flips through shared memory
+//   m - floods WarpMouse, and adds (plain and color), sets and deletes
+//       cursors; half of them take their events through an event ring, and
+//       they keep changing which events they want
+//   s - asks for mailbox mode and sends Draws without ever reading, so the
+//       server's replies back up until it gives up on the session
+//   c - connects, sets a video mode and disconnects, over and over
+//   f - sends random and malformed messages
+// Sessions which get closed (by the server or because they misbehaved) are
+// reconnected.  At the end, we check the server still works by connecting
+// one more well-behaved client and drawing a frame.
+//
+// Run the server headless (sdluxer -H) to leave your display alone.
+//
+// Usage: sdluxer_loadgen [-c socket] [-n sessions] [-t seconds] [-r roles]
+//                        [-S seed]
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "sdlux_client.h"
+#include "stats.h"
+
+typedef enum
+{
+  RoleDraw,
+  RoleMotion,
+  RoleStall,
+  RoleChurn,
+  RoleFuzz,
+  NUM_ROLES
+} Role;
+
+static const char role_chars[] = "dmscf";
+static const char * role_names[] = {"draw", "motion", "stall", "churn", "fuzz"};
+
+typedef struct
+{
+  uint64_t connects;
+  uint64_t closes; // Connections ended, for whatever reason
+  uint64_t sent; // Messages
+  uint64_t received; // Messages
+  uint64_t events; // Input events received
+  uint64_t mode_changes;
+  uint64_t frames;
+} RoleStats;
+
+typedef struct
+{
+  SdluxClient c;
+  Role role;
+  bool connected;
+  uint32_t seed;
+  int frames; // Since the last mode change
+  int cursors;
+} LoadSession;
+
+static const char * sock_path = NULL;
+static int num_sessions = 100;
+static int seconds = 10;
+static const char * roles = role_chars;
+static uint32_t seed = 1;
+
+static RoleStats role_stats[NUM_ROLES];
+static uint64_t connect_failures = 0;
+static uint64_t last_connect = 0; // When a connect last worked (us)
+
+static uint32_t rnd (LoadSession * l)
+{
+  // xorshift32
+  uint32_t x = l->seed;
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  return l->seed = x;
+}
+
+// Random integer in [lo, hi]
+static int rnd_range (LoadSession * l, int lo, int hi)
+{
+  return lo + rnd(l) % (hi - lo + 1);
+}
+
+static bool random_mode (LoadSession * l)
+{
+  static const int depths[] = {8, 16, 32};
+  int depth = depths[rnd(l) % 3];
+  int buffers = rnd_range(l, 1, 3);
+  if (!sdlux_set_video_mode(&l->c, rnd_range(l, 16, 400), rnd_range(l, 16, 300), depth, buffers > 1, buffers)) return false;
+  role_stats[l->role].sent++;
+  role_stats[l->role].mode_changes++;
+  l->frames = 0;
+
+  if (l->c.depth == 8)
+  {
+    SDL_Color colors[256];
+    for (int i = 0; i < 256; i++)
+    {
+      uint32_t r = rnd(l);
+      colors[i].r = r;
+      colors[i].g = r >> 8;
+      colors[i].b = r >> 16;
+    }
+    if (!sdlux_set_palette(&l->c, 0, 256, colors)) return false;
+    role_stats[l->role].sent++;
+  }
+  return true;
+}
+
+static bool open_session (LoadSession * l)
+{
+  if (!sdlux_connect(&l->c, sock_path))
+  {
+    connect_failures++;
+    return false;
+  }
+  l->connected = true;
+  l->cursors = 0;
+  last_connect = stats_now_us();
+  role_stats[l->role].connects++;
+
+  bool ok;
+  switch (l->role)
+  {
+    case RoleDraw:
+      ok = random_mode(l);
+      if (ok && rnd(l) % 2)
+      {
+        ok = sdlux_set_present_sync(&l->c, true);
+        role_stats[l->role].sent++;
+      }
+      break;
+    case RoleStall:
+      ok = sdlux_set_video_mode(&l->c, 64, 64, 32, true, 3);
+      role_stats[l->role].sent++;
+      break;
+    case RoleMotion:
+      ok = random_mode(l);
+      if (ok && rnd(l) % 2)
+      {
+        ok = sdlux_set_event_ring(&l->c, rnd(l) % 2 ? 0 : rnd_range(l, 0, 8192));
+        role_stats[l->role].sent++;
+      }
+      break;
+    case RoleFuzz:
+      // Sometimes start without a window, which some messages require
+      ok = (rnd(l) & 1) || random_mode(l);
+      break;
+    default:
+      ok = random_mode(l);
+      break;
+  }
+  return ok;
+}
+
+static void lose_session (LoadSession * l)
+{
+  if (!l->connected) return;
+  sdlux_close(&l->c);
+  l->connected = false;
+  role_stats[l->role].closes++;
+}
+
+static bool step_draw (LoadSession * l)
+{
+  if (l->frames > 0 && rnd(l) % 64 == 0) return random_mode(l);
+  if (rnd(l) % 256 == 0)
+  {
+    char caption[32];
+    snprintf(caption, sizeof(caption), "loadgen %u", (unsigned)rnd(l));
+    if (!sdlux_set_caption(&l->c, caption)) return false;
+    role_stats[l->role].sent++;
+  }
+
+  if (!sdlux_check_present(&l->c, false)) return true;
+
+  // Touch a few rows so the frame isn't just the last one again
+  char * p = sdlux_back_buffer(&l->c);
+  int y = rnd(l) % l->c.h;
+  memset(p + y * l->c.pitch, rnd(l), l->c.pitch);
+
+  bool flip = l->c.buffers > 1;
+  bool ok;
+  if (rnd(l) & 1)
+  {
+    ok = sdlux_draw(&l->c, flip);
+  }
+  else
+  {
+    // Including some which are partly or entirely off the surface
+    SDL_Rect rects[8];
+    int count = rnd_range(l, 1, 8);
+    for (int i = 0; i < count; i++)
+    {
+      rects[i].x = rnd_range(l, -32, l->c.w);
+      rects[i].y = rnd_range(l, -32, l->c.h);
+      rects[i].w = rnd_range(l, 0, l->c.w);
+      rects[i].h = rnd_range(l, 0, l->c.h);
+    }
+    ok = sdlux_draw_rects(&l->c, flip, count, rects);
+  }
+  if (!ok) return false;
+  role_stats[l->role].sent++;
+  role_stats[l->role].frames++;
+  l->frames++;
+  return true;
+}
+
+static bool step_motion (LoadSession * l)
+{
+  if (rnd(l) % 128 == 0)
+  {
+    uint8_t data[2 * 16 * 16 / 8];
+    for (int i = 0; i < sizeof(data); i++) data[i] = rnd(l);
+    int index;
+    if (rnd(l) % 2)
+    {
+      index = sdlux_add_cursor(&l->c, 16, 16, rnd_range(l, 0, 15), rnd_range(l, 0, 15), data, data + sizeof(data) / 2);
+    }
+    else
+    {
+      uint32_t pixels[16 * 16];
+      for (int i = 0; i < 16 * 16; i++) pixels[i] = rnd(l);
+      index = sdlux_add_color_cursor(&l->c, 16, 16, rnd_range(l, 0, 15), rnd_range(l, 0, 15), pixels);
+    }
+    role_stats[l->role].sent++;
+    if (index < 0) return false;
+    l->cursors = index + 1;
+  }
+  if (l->cursors && rnd(l) % 16 == 0)
+  {
+    int op = rnd_range(l, CursorOpSet, CursorOpHide);
+    if (!sdlux_manage_cursor(&l->c, op, rnd_range(l, -1, l->cursors - 1))) return false;
+    role_stats[l->role].sent++;
+  }
+
+  if (rnd(l) % 64 == 0)
+  {
+    // Mostly everything, but sometimes without motion or at random
+    uint32_t mask = SDLUX_EVENT_TYPES;
+    if (rnd(l) % 2) mask &= ~MouseMoveEvent;
+    else if (rnd(l) % 2) mask = rnd(l);
+    if (!sdlux_set_event_mask(&l->c, mask)) return false;
+    role_stats[l->role].sent++;
+  }
+
+  // Several at a time, so there's more motion than anything else
+  for (int i = 0; i < 8; i++)
+  {
+    if (!sdlux_warp_mouse(&l->c, rnd_range(l, -8, l->c.w + 8), rnd_range(l, -8, l->c.h + 8))) return false;
+    role_stats[l->role].sent++;
+  }
+  return true;
+}
+
+static bool step_stall (LoadSession * l)
+{
+  for (int i = 0; i < 16; i++)
+  {
+    if (!sdlux_draw(&l->c, true)) return false;
+    role_stats[l->role].sent++;
+    role_stats[l->role].frames++;
+  }
+  return true;
+}
+
+static bool step_churn (LoadSession * l)
+{
+  lose_session(l);
+  return true;
+}
+
+static bool step_fuzz (LoadSession * l)
+{
+  static const MsgType types[] = {SetVideoMode, Draw, WarpMouse, WM_SetCaption, AddCursor, ManageCursor, DrawRects, SetPalette, AddColorCursor, SetEventRing, SetPresentSync, SetEventMask};
+  uint8_t buf[512];
+  int size = rnd(l) % sizeof(buf);
+  for (int i = 0; i < size; i++) buf[i] = rnd(l);
+
+  MsgType type;
+  switch (rnd(l) % 8)
+  {
+    case 0:
+      // Not one of ours at all
+      type = rnd(l);
+      break;
+    case 1:
+      // A DrawRects with a plausible header and a wild count
+      type = DrawRects;
+      if (size < sizeof(DrawRectsMsg)) size = sizeof(DrawRectsMsg);
+      ((DrawRectsMsg*)buf)->version = SDLUX_DRAWRECTS_VERSION;
+      break;
+    case 2:
+      // A SetVideoMode which is small enough that it might actually work
+      type = SetVideoMode;
+      if (size < sizeof(SetVideoModeMsg)) size = sizeof(SetVideoModeMsg);
+      ((SetVideoModeMsg*)buf)->w = rnd_range(l, -16, 512);
+      ((SetVideoModeMsg*)buf)->h = rnd_range(l, -16, 512);
+      break;
+    default:
+      type = types[rnd(l) % (sizeof(types) / sizeof(types[0]))];
+      break;
+  }
+  if (!sdlux_send(&l->c, type, buf, size)) return false;
+  role_stats[l->role].sent++;
+  return true;
+}
+
+static bool step (LoadSession * l)
+{
+  switch (l->role)
+  {
+    case RoleDraw: return step_draw(l);
+    case RoleMotion: return step_motion(l);
+    case RoleStall: return step_stall(l);
+    case RoleChurn: return step_churn(l);
+    case RoleFuzz: return step_fuzz(l);
+    default: return false;
+  }
+}
+
+// Reads whatever is waiting
+static bool drain (LoadSession * l)
+{
+  static char buf[4096];
+  int r;
+  while (sdlux_recv_ring(&l->c, buf, sizeof(buf)) > 0) role_stats[l->role].events++;
+  while ((r = sdlux_recv(&l->c, buf, sizeof(buf), false)) > 0)
+  {
+    role_stats[l->role].received++;
+    int32_t type = *(int32_t*)buf;
+    if (type & SDLUX_EVENT_TYPES) role_stats[l->role].events++;
+  }
+  return r == 0;
+}
+
+// Connects a well-behaved client and checks it can get a frame shown
+static bool check_server (void)
+{
+  SdluxClient c;
+  if (!sdlux_connect(&c, sock_path)) return false;
+  bool ok = sdlux_set_video_mode(&c, 64, 64, 32, true, 2) && sdlux_draw(&c, true);
+  static char buf[4096];
+  struct pollfd pfd = {c.fd, POLLIN, 0};
+  uint64_t end = stats_now_us() + 5000000;
+  while (ok && c.flip_wait)
+  {
+    uint64_t now = stats_now_us();
+    if (now >= end || poll(&pfd, 1, (end - now) / 1000 + 1) <= 0) ok = false;
+    else if (sdlux_recv(&c, buf, sizeof(buf), false) < 0) ok = false;
+  }
+  sdlux_close(&c);
+  return ok;
+}
+
+int main (int argc, char * argv[])
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "c:n:t:r:S:")) != -1)
+  {
+    switch (opt)
+    {
+      case 'c': sock_path = optarg; break;
+      case 'n': num_sessions = atoi(optarg); break;
+      case 't': seconds = atoi(optarg); break;
+      case 'r': roles = optarg; break;
+      case 'S': seed = strtoul(optarg, NULL, 0); break;
+      default:
+        fprintf(stderr, "Usage: %s [-c socket] [-n sessions] [-t seconds] [-r roles] [-S seed]\n", argv[0]);
+        return 1;
+    }
+  }
+  if (num_sessions < 1) num_sessions = 1;
+  if (!sock_path) sock_path = getenv("SDLUXER_SERVER");
+  if (!sock_path) sock_path = "sdluxersock";
+
+  int num_roles = 0;
+  Role role_list[NUM_ROLES * 4];
+  for (const char * r = roles; *r && num_roles < NUM_ROLES * 4; r++)
+  {
+    const char * p = strchr(role_chars, *r);
+    if (!p)
+    {
+      fprintf(stderr, "Unknown role '%c' (should be some of %s)\n", *r, role_chars);
+      return 1;
+    }
+    role_list[num_roles++] = p - role_chars;
+  }
+  if (!num_roles) return 1;
+
+  LoadSession * sessions = calloc(num_sessions, sizeof(LoadSession));
+  struct pollfd * pfds = calloc(num_sessions, sizeof(struct pollfd));
+  if (!sessions || !pfds) return 1;
+  for (int i = 0; i < num_sessions; i++)
+  {
+    sessions[i].role = role_list[i % num_roles];
+    sessions[i].seed = seed * 2654435761u + i + 1;
+    sessions[i].c.fd = -1;
+  }
+
+  uint64_t start = stats_now_us();
+  uint64_t end = start + (uint64_t)seconds * 1000000;
+  last_connect = start;
+  while (stats_now_us() < end)
+  {
+    if (stats_now_us() - last_connect > 2000000)
+    {
+      fprintf(stderr, "Can't connect to %s any more\n", sock_path);
+      break;
+    }
+
+    for (int i = 0; i < num_sessions; i++)
+    {
+      LoadSession * l = &sessions[i];
+      if (!l->connected && !open_session(l)) lose_session(l);
+      else if (l->connected && !step(l)) lose_session(l);
+      pfds[i].fd = l->connected ? l->c.fd : -1;
+      // Stalled sessions never read, but we still want to see them close
+      pfds[i].events = l->role == RoleStall ? 0 : POLLIN;
+    }
+
+    if (poll(pfds, num_sessions, 0) < 0 && errno != EINTR) break;
+
+    for (int i = 0; i < num_sessions; i++)
+    {
+      LoadSession * l = &sessions[i];
+      if (!l->connected) continue;
+      if ((pfds[i].revents & POLLIN) || l->c.ring_mem)
+      {
+        if (!drain(l)) lose_session(l);
+      }
+      else if (pfds[i].revents & (POLLHUP | POLLERR))
+      {
+        lose_session(l);
+      }
+    }
+  }
+  double elapsed = (stats_now_us() - start) / 1000000.0;
+
+  for (int i = 0; i < num_sessions; i++)
+  {
+    if (sessions[i].connected) sdlux_close(&sessions[i].c);
+  }
+
+  printf("sessions %i\n", num_sessions);
+  printf("seconds %.3f\n", elapsed);
+  for (int r = 0; r < NUM_ROLES; r++)
+  {
+    RoleStats * rs = &role_stats[r];
+    if (!rs->connects) continue;
+#define STAT(name) printf("%s_" #name " %llu\n", role_names[r], (unsigned long long)rs->name)
+    STAT(connects);
+    STAT(closes);
+    STAT(sent);
+    STAT(received);
+    STAT(events);
+    STAT(mode_changes);
+    STAT(frames);
+#undef STAT
+  }
+  printf("connect_failures %llu\n", (unsigned long long)connect_failures);
+
+  bool alive = check_server();
+  printf("server_ok %s\n", alive ? "yes" : "no");
+  return alive ? 0 : 1;
+}
@@ -0,0 +1,293 @@
+#define _GNU_SOURCE
+#include "record.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "stats.h"
+
+// Frames are compared in chunks this big.  Smaller finds changes more
+// precisely, but spans have more overhead.
+#define RECORD_CHUNK 64
+
+// Records are put together by the render thread, and written by a thread
+// of our own, so a slow disk doesn't hold up frames (until we've got too
+// much queued; see RECORD_MAX_QUEUED)
+#define RECORD_MAX_QUEUED (64 * 1024 * 1024)
+
+// Buffers written are kept to be used again, up to this many
+#define RECORD_MAX_SPARE 8
+
+typedef struct RecordBuf
+{
+  struct RecordBuf * next;
+  size_t size; // Space in data
+  size_t length; // How much of it is used
+  uint8_t data[];
+} RecordBuf;
+
+static FILE * rec_file;
+static uint64_t rec_start;
+
+static pthread_t writer;
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queued_cond = PTHREAD_COND_INITIALIZER; // Or stopping
+static pthread_cond_t written_cond = PTHREAD_COND_INITIALIZER;
+static RecordBuf * queue_head;
+static RecordBuf ** queue_tail = &queue_head;
+static size_t queued_bytes;
+static RecordBuf * spare;
+static int num_spare;
+static bool stopping;
+static int write_error; // errno once the writer has failed
+
+static void * writer_main (void * unused)
+{
+  pthread_mutex_lock(&lock);
+  while (true)
+  {
+    while (!queue_head && !stopping) pthread_cond_wait(&queued_cond, &lock);
+    RecordBuf * b = queue_head;
+    if (!b) break; // Stopping, and everything's written
+    queue_head = b->next;
+    if (!queue_head) queue_tail = &queue_head;
+    pthread_mutex_unlock(&lock);
+
+    // Once a write fails, the recording is no good, so just drain the queue
+    int e = 0;
+    if (!write_error && fwrite(b->data, b->length, 1, rec_file) != 1) e = errno ? errno : EIO;
+
+    pthread_mutex_lock(&lock);
+    if (e) write_error = e;
+    queued_bytes -= b->length;
+    if (num_spare < RECORD_MAX_SPARE)
+    {
+      b->next = spare;
+      spare = b;
+      num_spare++;
+    }
+    else
+    {
+      free(b);
+    }
+    pthread_cond_signal(&written_cond);
+  }
+  pthread_mutex_unlock(&lock);
+  return NULL;
+}
+
+// A buffer with room for at least size bytes, or NULL with errno set
+static RecordBuf * get_buf (size_t size)
+{
+  pthread_mutex_lock(&lock);
+  RecordBuf ** pp = &spare;
+  while (*pp && (*pp)->size < size) pp = &(*pp)->next;
+  if (!*pp) pp = &spare; // Nothing big enough; grow one
+  RecordBuf * b = *pp;
+  if (b)
+  {
+    *pp = b->next;
+    num_spare--;
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (b && b->size >= size) return b;
+  // Small records share buffers with frames, so don't bother with tiny ones
+  if (size < 64 * 1024) size = 64 * 1024;
+  RecordBuf * nb = realloc(b, sizeof(RecordBuf) + size);
+  if (!nb)
+  {
+    free(b);
+    return NULL;
+  }
+  nb->size = size;
+  return nb;
+}
+
+// Hands b to the writer.  Returns false with errno set if the writer has
+// failed.
+static bool queue_buf (RecordBuf * b)
+{
+  pthread_mutex_lock(&lock);
+  // If the disk can't keep up, we have to wait for it sooner or later
+  while (queued_bytes > RECORD_MAX_QUEUED && !write_error)
+  {
+    pthread_cond_wait(&written_cond, &lock);
+  }
+  int e = write_error;
+  if (!e)
+  {
+    b->next = NULL;
+    *queue_tail = b;
+    queue_tail = &b->next;
+    queued_bytes += b->length;
+    pthread_cond_signal(&queued_cond);
+  }
+  pthread_mutex_unlock(&lock);
+
+  if (!e) return true;
+  free(b);
+  errno = e;
+  return false;
+}
+
+bool record_start (const char * path)
+{
+  rec_file = fopen(path, "wb");
+  if (!rec_file) return false;
+  // Frames are big, so write them in big pieces
+  setvbuf(rec_file, NULL, _IOFBF, 1024 * 1024);
+
+  RecordFileHeader fh = {};
+  memcpy(fh.magic, RECORD_MAGIC, sizeof(fh.magic));
+  fh.version = RECORD_VERSION;
+  rec_start = stats_now_us();
+  stopping = false;
+  write_error = 0;
+  int e = 0;
+  if (fwrite(&fh, sizeof(fh), 1, rec_file) != 1) e = errno;
+  else e = pthread_create(&writer, NULL, writer_main, NULL);
+  if (e)
+  {
+    fclose(rec_file);
+    rec_file = NULL;
+    errno = e;
+    return false;
+  }
+  return true;
+}
+
+void record_stop (void)
+{
+  if (!rec_file) return;
+  pthread_mutex_lock(&lock);
+  stopping = true;
+  pthread_cond_signal(&queued_cond);
+  pthread_mutex_unlock(&lock);
+  pthread_join(writer, NULL);
+
+  fclose(rec_file);
+  rec_file = NULL;
+  while (spare)
+  {
+    RecordBuf * b = spare;
+    spare = b->next;
+    free(b);
+  }
+  num_spare = 0;
+}
+
+// Queues a record whose data the caller has put after the header in b
+static bool queue_record (RecordBuf * b, uint32_t session, RecordKind kind, uint32_t length)
+{
+  RecordHeader h = {stats_now_us() - rec_start, session, kind, length};
+  memcpy(b->data, &h, sizeof(h));
+  b->length = sizeof(h) + length;
+  return queue_buf(b);
+}
+
+static bool write_record (uint32_t session, RecordKind kind, const void * data, uint32_t length)
+{
+  if (!rec_file) return true;
+  RecordBuf * b = get_buf(sizeof(RecordHeader) + length);
+  if (!b) return false;
+  if (length) memcpy(b->data + sizeof(RecordHeader), data, length);
+  return queue_record(b, session, kind, length);
+}
+
+bool record_open (uint32_t session)
+{
+  return write_record(session, RecordOpen, NULL, 0);
+}
+
+static void free_shadow (RecordShadow * shadow)
+{
+  for (int i = 0; i < RECORD_MAX_BUFFERS; i++) free(shadow->pixels[i]);
+  memset(shadow, 0, sizeof(*shadow));
+}
+
+bool record_close (uint32_t session, RecordShadow * shadow)
+{
+  free_shadow(shadow);
+  return write_record(session, RecordClose, NULL, 0);
+}
+
+bool record_message (uint32_t session, const void * buf, int length)
+{
+  return write_record(session, RecordMessage, buf, length);
+}
+
+bool record_presented (uint32_t session)
+{
+  return write_record(session, RecordPresented, NULL, 0);
+}
+
+bool record_frame (uint32_t session, RecordShadow * shadow, int buffer, const void * pixels, int pitch, int w, int h, int depth)
+{
+  if (!rec_file) return true;
+  if (buffer < 0 || buffer >= RECORD_MAX_BUFFERS) buffer = 0;
+  size_t row = (size_t)w * depth / 8;
+  size_t size = row * h;
+
+  if (shadow->w != w || shadow->h != h || shadow->depth != depth) free_shadow(shadow);
+  if (!shadow->pixels[buffer])
+  {
+    shadow->pixels[buffer] = calloc(size ? size : 1, 1);
+    if (!shadow->pixels[buffer]) return false;
+    shadow->w = w;
+    shadow->h = h;
+    shadow->depth = depth;
+  }
+
+  // Worst case is a span for every chunk, as when every other chunk
+  // changes, or every other row of an image narrower than a chunk
+  size_t chunks = (size_t)h * ((row + RECORD_CHUNK - 1) / RECORD_CHUNK);
+  size_t need = sizeof(RecordFrameHeader) + size + chunks * sizeof(RecordSpan);
+  RecordBuf * b = get_buf(sizeof(RecordHeader) + need);
+  if (!b) return false;
+  uint8_t * frame = b->data + sizeof(RecordHeader);
+
+  RecordFrameHeader fh = {w, h, depth, buffer};
+  memcpy(frame, &fh, sizeof(fh));
+  uint8_t * o = frame + sizeof(fh);
+
+  // Spans carry on across rows when the end of one and the start of the
+  // next both changed, since rows are packed
+  uint8_t * span_at = NULL; // Where the span we're adding to goes
+  RecordSpan span = {};
+  size_t last_end = 0;
+  for (int y = 0; y < h; y++)
+  {
+    const uint8_t * src = (const uint8_t *)pixels + (size_t)y * pitch;
+    uint8_t * old = shadow->pixels[buffer] + y * row;
+    size_t base = y * row;
+    for (size_t x = 0; x < row; x += RECORD_CHUNK)
+    {
+      size_t n = row - x < RECORD_CHUNK ? row - x : RECORD_CHUNK;
+      if (!memcmp(src + x, old + x, n))
+      {
+        if (span_at) memcpy(span_at, &span, sizeof(span));
+        span_at = NULL;
+        continue;
+      }
+      memcpy(old + x, src + x, n);
+      if (!span_at)
+      {
+        span_at = o;
+        o += sizeof(span);
+        span.skip = base + x - last_end;
+        span.len = 0;
+      }
+      memcpy(o, src + x, n);
+      o += n;
+      span.len += n;
+      last_end = base + x + n;
+    }
+  }
+  if (span_at) memcpy(span_at, &span, sizeof(span));
+
+  return queue_record(b, session, RecordFrame, o - frame);
+}
@@ -0,0 +1,112 @@
+#ifndef SDLUXER_RECORD_H
+#define SDLUXER_RECORD_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// Records everything clients send, so that sdluxer_replay can play it back
+// against a (headless) server later, with the same timing or as fast as
+// possible.  That makes problems which depend on how real clients behave
+// something we can profile over and over.
+//
+// A recording is a RecordFileHeader, then records, each of which is a
+// RecordHeader followed by length bytes:
+//   RecordOpen - a session connected (no data)
+//   RecordClose - it went away (no data)
+//   RecordMessage - a message from it, type and all, as it arrived
+//   RecordFrame - what was in the buffer it drew into, just before the Draw
+//                 or DrawRects message which follows
+//   RecordPresented - we told it a frame had been shown (or in mailbox
+//                     mode, that a Draw was taken), so a client which
+//                     waits for that could go on (no data)
+//
+// A frame is a RecordFrameHeader and then spans, each a RecordSpan and len
+// bytes.  They're the bytes which differ from the last frame the session
+// drew in the same buffer (which is what was left there), with the image
+// packed as w*depth/8 byte rows (no pitch padding).  The first frame in
+// each buffer, and the first after a change of size or depth, is relative
+// to zeros.
+//
+// Times are in us from the start of the recording, as the render thread
+// handled them.
+//
+// Recording isn't free, so it skews timings a little.  On every Draw, the
+// render thread compares the whole frame with its shadow copy and copies
+// out what changed.  Writing that is left to a thread of our own, though
+// if the disk falls more than 64 MB behind, frames wait for it.
+
+#define RECORD_MAGIC "SDLUXREC"
+#define RECORD_VERSION 1
+
+#define RECORD_MAX_BUFFERS 3
+
+typedef struct
+{
+  char magic[8];
+  uint32_t version;
+  uint32_t reserved;
+} RecordFileHeader;
+
+typedef enum
+{
+  RecordOpen = 1,
+  RecordClose = 2,
+  RecordMessage = 3,
+  RecordFrame = 4,
+  RecordPresented = 5,
+} RecordKind;
+
+typedef struct
+{
+  uint64_t time;
+  uint32_t session; // Unique for the life of the server
+  uint32_t kind;
+  uint32_t length;
+} __attribute__ ((packed, aligned (4))) RecordHeader;
+
+typedef struct
+{
+  int32_t w;
+  int32_t h;
+  int32_t depth;
+  int32_t buffer; // Which of the client's buffers it was drawn in
+} RecordFrameHeader;
+
+typedef struct
+{
+  uint32_t skip; // Unchanged bytes since the end of the last span
+  uint32_t len;
+} RecordSpan;
+
+// The last frame recorded in each of a session's buffers, which the next
+// one there is compared with
+typedef struct RecordShadow
+{
+  uint8_t * pixels[RECORD_MAX_BUFFERS];
+  int w;
+  int h;
+  int depth;
+} RecordShadow;
+
+// Starts recording to path.  Returns false with errno set on failure.
+bool record_start (const char * path);
+
+// Flushes and closes the recording
+void record_stop (void);
+
+// These return false with errno set if the recording couldn't be written
+
+bool record_open (uint32_t session);
+
+// Also frees the shadow
+bool record_close (uint32_t session, RecordShadow * shadow);
+
+bool record_message (uint32_t session, const void * buf, int length);
+
+bool record_presented (uint32_t session);
+
+// Records whatever changed in the w*h image at pixels since the last frame
+// in the same buffer, and updates shadow
+bool record_frame (uint32_t session, RecordShadow * shadow, int buffer, const void * pixels, int pitch, int w, int h, int depth);
+
+#endif
@@ -0,0 +1,425 @@
+// Plays back a recording made with sdluxer -R against a server, for
+// profiling the server with the same clients over and over.
+//
+// Each recorded session gets a connection of its own, which sends what the
+// original client sent, with its frames drawn into the framebuffer before
+// each Draw.  By default, messages go out with the timing they were
+// recorded with; with -m, they go out as fast as the server takes them.
+// A session which is waiting for its last frame to be shown waits for that
+// before drawing again if the original client did (as the recording shows),
+// or always with -m.  Events and replies from the server are read and
+// thrown away.
+//
+// With -x, the server is started (headless) on a temporary socket, as with
+// sdluxer_bench.  Otherwise we connect to -c, $SDLUXER_SERVER or
+// ./sdluxersock.  At the end we report how long it took and how much was
+// sent.
+//
+// Usage: sdluxer_replay [-x server] [-c socket] [-m] recording
+
+#define _GNU_SOURCE
+#include <errno.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "record.h"
+#include "sdlux_client.h"
+#include "stats.h"
+
+typedef struct
+{
+  uint32_t id; // From the recording
+  SdluxClient c;
+
+  // What it last drew in each buffer, from RecordFrames
+  uint8_t * frames[RECORD_MAX_BUFFERS];
+  int w;
+  int h;
+  int depth;
+  int frame; // The buffer the last RecordFrame was for, or -1 if it's been used
+  bool presented; // The original client had heard its last frame was shown
+} ReplaySession;
+
+static const char * server_path = NULL;
+static const char * sock_path = NULL;
+static bool max_speed = false;
+
+static pid_t server_pid = -1;
+static char tmp_sock[108];
+
+static ReplaySession * sessions;
+static int num_sessions;
+static int max_sessions;
+
+static uint64_t messages;
+static uint64_t frames;
+static uint64_t lost; // Sessions the server closed on us
+static uint64_t late; // Messages we couldn't send on time
+static Histogram lateness; // ...and by how much (us)
+
+static void start_server (void)
+{
+  snprintf(tmp_sock, sizeof(tmp_sock), "/tmp/sdluxer_replay_%i", (int)getpid());
+  unlink(tmp_sock);
+  server_pid = fork();
+  if (server_pid == 0)
+  {
+    execl(server_path, server_path, "-H", "-n", tmp_sock, (char*)NULL);
+    perror("exec");
+    _exit(1);
+  }
+  sock_path = tmp_sock;
+}
+
+static void stop_server (void)
+{
+  if (server_pid < 0) return;
+  kill(server_pid, SIGINT);
+  waitpid(server_pid, NULL, 0);
+  server_pid = -1;
+}
+
+static ReplaySession * find_session (uint32_t id)
+{
+  for (int i = 0; i < num_sessions; i++)
+  {
+    if (sessions[i].id == id) return &sessions[i];
+  }
+  return NULL;
+}
+
+static void free_frames (ReplaySession * r)
+{
+  for (int i = 0; i < RECORD_MAX_BUFFERS; i++)
+  {
+    free(r->frames[i]);
+    r->frames[i] = NULL;
+  }
+}
+
+static void close_session (ReplaySession * r)
+{
+  sdlux_close(&r->c);
+  free_frames(r);
+  *r = sessions[--num_sessions];
+}
+
+static void open_session (uint32_t id)
+{
+  if (find_session(id)) return;
+  if (num_sessions == max_sessions)
+  {
+    max_sessions = max_sessions ? max_sessions * 2 : 16;
+    sessions = realloc(sessions, max_sessions * sizeof(ReplaySession));
+    if (!sessions)
+    {
+      fprintf(stderr, "Out of memory\n");
+      stop_server();
+      exit(1);
+    }
+  }
+
+  ReplaySession * r = &sessions[num_sessions];
+  memset(r, 0, sizeof(*r));
+  r->id = id;
+  r->frame = -1;
+  // If we just started the server, give it a moment to come up
+  for (int tries = 0; tries < 50; tries++)
+  {
+    if (sdlux_connect(&r->c, sock_path))
+    {
+      num_sessions++;
+      return;
+    }
+    if (server_pid < 0 || messages) break;
+    usleep(100000);
+  }
+  if (messages)
+  {
+    // The server has been up, so it's just busy (or gone)
+    lost++;
+    return;
+  }
+  fprintf(stderr, "Couldn't connect to %s\n", sock_path);
+  stop_server();
+  exit(1);
+}
+
+// Reads and drops whatever the server has sent.  Returns false if the
+// server closed the session.
+static bool drain (ReplaySession * r)
+{
+  static char buf[4096];
+  while (sdlux_recv_ring(&r->c, buf, sizeof(buf)) > 0) {}
+  int n;
+  while ((n = sdlux_recv(&r->c, buf, sizeof(buf), false)) > 0) {}
+  return n == 0;
+}
+
+static void lose_session (ReplaySession * r)
+{
+  lost++;
+  close_session(r);
+}
+
+// Waits up to timeout ms for the server to send something, and reads
+// whatever it has.  Event rings are always emptied, so they don't overflow.
+static void drain_all (int timeout)
+{
+  struct pollfd pfds[num_sessions ? num_sessions : 1];
+  for (int i = 0; i < num_sessions; i++)
+  {
+    pfds[i].fd = sessions[i].c.fd;
+    pfds[i].events = POLLIN;
+    pfds[i].revents = 0;
+  }
+  if (poll(pfds, num_sessions, timeout) < 0) return;
+  for (int i = num_sessions - 1; i >= 0; i--)
+  {
+    if (!pfds[i].revents && sessions[i].c.ring_bell < 0) continue;
+    if (!drain(&sessions[i])) lose_session(&sessions[i]);
+  }
+}
+
+// A client can't draw while the server might still be about to show what
+// it drew last.  Waits up to a second for that, in case the server has
+// stopped taking frames from us for some reason.
+static bool wait_flip (ReplaySession * r)
+{
+  uint64_t give_up = stats_now_us() + 1000000;
+  while (true)
+  {
+    if (!drain(r)) return false;
+    if (sdlux_check_present(&r->c, false) || stats_now_us() > give_up) return true;
+    struct pollfd pfd = {r->c.fd, POLLIN, 0};
+    poll(&pfd, 1, r->c.sync ? 1 : 100);
+  }
+}
+
+static bool apply_frame (ReplaySession * r, const uint8_t * data, uint32_t length)
+{
+  RecordFrameHeader fh;
+  if (length < sizeof(fh)) return false;
+  memcpy(&fh, data, sizeof(fh));
+  if (fh.w <= 0 || fh.h <= 0 || (fh.depth != 8 && fh.depth != 16 && fh.depth != 32)) return false;
+  if (fh.buffer < 0 || fh.buffer >= RECORD_MAX_BUFFERS) return false;
+  size_t size = (size_t)fh.w * fh.depth / 8 * fh.h;
+
+  if (fh.w != r->w || fh.h != r->h || fh.depth != r->depth) free_frames(r);
+  uint8_t * frame = r->frames[fh.buffer];
+  if (!frame)
+  {
+    frame = r->frames[fh.buffer] = calloc(size, 1);
+    if (!frame) return false;
+    r->w = fh.w;
+    r->h = fh.h;
+    r->depth = fh.depth;
+  }
+
+  const uint8_t * p = data + sizeof(fh);
+  const uint8_t * end = data + length;
+  size_t at = 0;
+  while (p < end)
+  {
+    RecordSpan span;
+    if (end - p < sizeof(span)) return false;
+    memcpy(&span, p, sizeof(span));
+    p += sizeof(span);
+    at += span.skip;
+    if (span.len > end - p || span.len > size || at > size - span.len) return false;
+    memcpy(frame + at, p, span.len);
+    p += span.len;
+    at += span.len;
+  }
+  r->frame = fh.buffer;
+  return true;
+}
+
+// Puts the session's frame where the server will look for it
+static void copy_frame (ReplaySession * r)
+{
+  SdluxClient * c = &r->c;
+  if (!c->shmem || c->w != r->w || c->h != r->h || c->depth != r->depth) return;
+  uint8_t * dst = sdlux_back_buffer(c);
+  const uint8_t * src = r->frames[r->frame];
+  size_t row = (size_t)r->w * r->depth / 8;
+  for (int y = 0; y < r->h; y++) memcpy(dst + (size_t)y * c->pitch, src + y * row, row);
+}
+
+static bool send_message (ReplaySession * r, const uint8_t * data, uint32_t length)
+{
+  SdluxClient * c = &r->c;
+  int32_t type;
+  memcpy(&type, data, 4);
+  const uint8_t * body = data + 4;
+  int size = length - 4;
+  messages++;
+
+  // These change what the client library needs to know, so go through it
+  if (type == SetVideoMode && size >= offsetof(SetVideoModeMsg, depth))
+  {
+    SetVideoModeMsg m = {};
+    memcpy(&m, body, size < sizeof(m) ? size : sizeof(m));
+    sdlux_set_video_mode(c, m.w, m.h, m.depth, m.double_buf, m.buffers);
+    return c->fd >= 0;
+  }
+  if (type == SetEventRing && size >= sizeof(SetEventRingMsg))
+  {
+    sdlux_set_event_ring(c, ((SetEventRingMsg *)body)->size);
+    return true;
+  }
+  if (type == SetPresentSync && size >= sizeof(SetPresentSyncMsg))
+  {
+    sdlux_set_present_sync(c, ((SetPresentSyncMsg *)body)->enable);
+    return true;
+  }
+
+  if ((type == Draw && size >= sizeof(DrawMsg)) || (type == DrawRects && size >= sizeof(DrawRectsMsg)))
+  {
+    if ((max_speed || r->presented) && !wait_flip(r)) return false;
+    r->presented = false;
+    if (!drain(r)) return false;
+    if (r->frame >= 0) copy_frame(r);
+    r->frame = -1;
+    frames++;
+    bool flip = type == Draw ? ((DrawMsg *)body)->flip : ((DrawRectsMsg *)body)->flip;
+    if (!sdlux_send(c, type, body, size)) return false;
+    if (flip && c->buffers != 3) c->flip_wait = true;
+    if (c->sync && c->buffers == 3) c->flip_wait = true;
+    return true;
+  }
+
+  return sdlux_send(c, type, body, size);
+}
+
+static bool read_record (FILE * f, RecordHeader * h, uint8_t ** data, size_t * data_size)
+{
+  if (fread(h, sizeof(*h), 1, f) != 1) return false;
+  if (h->length > *data_size)
+  {
+    uint8_t * nd = realloc(*data, h->length);
+    if (!nd) return false;
+    *data = nd;
+    *data_size = h->length;
+  }
+  return !h->length || fread(*data, h->length, 1, f) == 1;
+}
+
+int main (int argc, char * argv[])
+{
+  int opt;
+  while ((opt = getopt(argc, argv, "x:c:m")) != -1)
+  {
+    switch (opt)
+    {
+      case 'x': server_path = optarg; break;
+      case 'c': sock_path = optarg; break;
+      case 'm': max_speed = true; break;
+      default:
+        optind = argc;
+        break;
+    }
+  }
+  if (optind != argc - 1)
+  {
+    fprintf(stderr, "Usage: %s [-x server] [-c socket] [-m] recording\n", argv[0]);
+    return 1;
+  }
+
+  FILE * f = fopen(argv[optind], "rb");
+  RecordFileHeader fh;
+  if (!f || fread(&fh, sizeof(fh), 1, f) != 1 || memcmp(fh.magic, RECORD_MAGIC, sizeof(fh.magic)))
+  {
+    fprintf(stderr, "%s isn't an SDLuxer recording\n", argv[optind]);
+    return 1;
+  }
+  if (fh.version != RECORD_VERSION)
+  {
+    fprintf(stderr, "%s is version %u; we only know version %u\n", argv[optind], fh.version, RECORD_VERSION);
+    return 1;
+  }
+
+  if (!sock_path) sock_path = getenv("SDLUXER_SERVER");
+  if (!sock_path) sock_path = "sdluxersock";
+  if (server_path) start_server();
+
+  uint8_t * data = NULL;
+  size_t data_size = 0;
+  RecordHeader h;
+  uint64_t last_time = 0;
+  uint64_t start = stats_now_us();
+  while (read_record(f, &h, &data, &data_size))
+  {
+    last_time = h.time;
+    if (!max_speed)
+    {
+      uint64_t now;
+      while ((now = stats_now_us()) < start + h.time)
+      {
+        uint64_t ms = (start + h.time - now + 999) / 1000;
+        drain_all(ms > 100 ? 100 : ms);
+      }
+      // More than a ms out counts as late
+      if (h.kind == RecordMessage && now - start > h.time + 1000)
+      {
+        late++;
+        hist_add(&lateness, now - start - h.time);
+      }
+    }
+
+    if (h.kind == RecordOpen)
+    {
+      open_session(h.session);
+      continue;
+    }
+
+    ReplaySession * r = find_session(h.session);
+    if (!r) continue; // Lost or never opened
+    switch (h.kind)
+    {
+      case RecordClose:
+        close_session(r);
+        break;
+      case RecordPresented:
+        r->presented = true;
+        break;
+      case RecordFrame:
+        if (!apply_frame(r, data, h.length))
+        {
+          fprintf(stderr, "Bad frame for session %u\n", h.session);
+        }
+        break;
+      case RecordMessage:
+        if (h.length < 4) break;
+        if (!send_message(r, data, h.length) || !drain(r)) lose_session(r);
+        break;
+      default:
+        break;
+    }
+  }
+  // Give the server a moment to finish up
+  drain_all(100);
+  double elapsed = (stats_now_us() - start) / 1000000.0;
+  fclose(f);
+  free(data);
+
+  printf("seconds %.3f\n", elapsed);
+  printf("recorded_seconds %.3f\n", last_time / 1000000.0);
+  printf("messages %llu\n", (unsigned long long)messages);
+  printf("frames %llu\n", (unsigned long long)frames);
+  printf("sessions_lost %llu\n", (unsigned long long)lost);
+  if (!max_speed)
+  {
+    printf("late_messages %llu\n", (unsigned long long)late);
+    if (late) printf("late_us_p99 %llu\n", (unsigned long long)hist_percentile(&lateness, 99));
+  }
+
+  while (num_sessions) close_session(&sessions[num_sessions - 1]);
+  stop_server();
+  return 0;
+}
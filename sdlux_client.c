@@ -0,0 +1,470 @@
+#define _GNU_SOURCE
+#include "sdlux_client.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <linux/futex.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+bool sdlux_connect (SdluxClient * c, const char * path)
+{
+  memset(c, 0, sizeof(*c));
+  c->fd = -1;
+  c->recv_fds[0] = c->recv_fds[1] = -1;
+  c->ring_bell = -1;
+  if (!path) path = getenv("SDLUXER_SERVER");
+  if (!path) return false;
+
+  int fd = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_CLOEXEC, 0);
+  if (fd < 0) return false;
+
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, path, sizeof(addr.sun_path)-1);
+  if (connect(fd, (struct sockaddr*)&addr, sizeof(addr)))
+  {
+    close(fd);
+    return false;
+  }
+
+  c->fd = fd;
+  return true;
+}
+
+static void close_recv_fds (SdluxClient * c)
+{
+  for (int i = 0; i < 2; i++)
+  {
+    if (c->recv_fds[i] >= 0) close(c->recv_fds[i]);
+    c->recv_fds[i] = -1;
+  }
+}
+
+static void close_ring (SdluxClient * c)
+{
+  if (c->ring_mem) munmap(c->ring_mem, c->ring_mem_size);
+  c->ring_mem = NULL;
+  if (c->ring_bell >= 0) close(c->ring_bell);
+  c->ring_bell = -1;
+}
+
+static void close_sync (SdluxClient * c)
+{
+  if (c->sync) munmap(c->sync, sizeof(PresentSyncShared));
+  c->sync = NULL;
+}
+
+void sdlux_close (SdluxClient * c)
+{
+  if (c->shmem) munmap(c->shmem, c->shmem_size);
+  c->shmem = NULL;
+  close_sync(c);
+  if (c->fd >= 0) close(c->fd);
+  c->fd = -1;
+  close_recv_fds(c);
+  close_ring(c);
+}
+
+bool sdlux_send (SdluxClient * c, MsgType type, const void * data, int size)
+{
+  char buf[4 + size];
+  *(int32_t*)buf = type;
+  memcpy(buf + 4, data, size);
+  while (true)
+  {
+    ssize_t r = send(c->fd, buf, sizeof(buf), MSG_NOSIGNAL);
+    if (r == sizeof(buf)) return true;
+    if (r < 0 && errno == EINTR) continue;
+    return false;
+  }
+}
+
+int sdlux_recv (SdluxClient * c, void * buf, int size, bool block)
+{
+  while (true)
+  {
+    struct iovec iov = {buf, size};
+    union
+    {
+      char buf[CMSG_SPACE(sizeof(int) * 2)];
+      struct cmsghdr align;
+    } cbuf;
+    struct msghdr mh = {};
+    mh.msg_iov = &iov;
+    mh.msg_iovlen = 1;
+    mh.msg_control = cbuf.buf;
+    mh.msg_controllen = sizeof(cbuf.buf);
+    ssize_t r = recvmsg(c->fd, &mh, MSG_CMSG_CLOEXEC | (block ? 0 : MSG_DONTWAIT));
+    if (r < 0 && errno == EINTR) continue;
+    for (struct cmsghdr * cm = CMSG_FIRSTHDR(&mh); r >= 0 && cm; cm = CMSG_NXTHDR(&mh, cm))
+    {
+      if (cm->cmsg_level != SOL_SOCKET || cm->cmsg_type != SCM_RIGHTS) continue;
+      close_recv_fds(c);
+      int n = (cm->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+      if (n > 2) n = 2; // MSG_CTRUNC would have dropped any more anyway
+      memcpy(c->recv_fds, CMSG_DATA(cm), n * sizeof(int));
+    }
+    if (r < 0 && !block && (errno == EAGAIN || errno == EWOULDBLOCK)) return 0;
+    if (r < 4) return -1;
+
+    int32_t type = *(int32_t*)buf;
+    if (type == Flipped)
+    {
+      if (c->buffers == 2) c->back ^= 1;
+      c->flip_wait = false;
+      memset(&c->flipped, 0, sizeof(c->flipped));
+      memcpy(&c->flipped, (char*)buf + 4, r - 4 < sizeof(c->flipped) ? r - 4 : sizeof(c->flipped));
+    }
+    else if (type == NextBuffer && r >= 4 + sizeof(NextBufferMsg))
+    {
+      NextBufferMsg * m = (void*)((char*)buf + 4);
+      if (m->index >= 0 && m->index < c->buffers) c->back = m->index;
+    }
+    return r;
+  }
+}
+
+bool sdlux_set_video_mode (SdluxClient * c, int w, int h, int depth, bool double_buf, int buffers)
+{
+  SetVideoModeMsg m = {};
+  m.w = w;
+  m.h = h;
+  m.depth = depth;
+  m.double_buf = double_buf;
+  m.buffers = buffers;
+  m.want_fd = true;
+  if (!sdlux_send(c, SetVideoMode, &m, sizeof(m))) return false;
+
+  static char buf[4096];
+  VideoModeSetMsg * vm = (void*)(buf + 4);
+  while (true)
+  {
+    int r = sdlux_recv(c, buf, sizeof(buf) - 1, true);
+    if (r < 0) return false;
+    if (*(int32_t*)buf != VideoModeSet || r < 4 + sizeof(*vm)) continue;
+    buf[r] = 0;
+    break;
+  }
+  if (!vm->success) return false;
+
+  if (c->shmem) munmap(c->shmem, c->shmem_size);
+  c->shmem = NULL;
+
+  c->w = vm->w;
+  c->h = vm->h;
+  c->pitch = vm->pitch;
+  c->depth = vm->depth;
+  c->buffers = !vm->double_buf ? 1 : (buffers >= 3 ? 3 : 2);
+  c->back = 0;
+  c->flip_wait = false;
+  c->shmem_size = (size_t)c->pitch * c->h * c->buffers;
+
+  int memfd;
+  if (vm->name[0])
+  {
+    memfd = shm_open(vm->name, O_RDWR, 0);
+  }
+  else
+  {
+    memfd = c->recv_fds[0];
+    c->recv_fds[0] = -1;
+  }
+  if (memfd < 0) return false;
+  // Memory backed by huge pages has to be mapped in whole huge pages
+  struct stat st;
+  if (fstat(memfd, &st) == 0 && st.st_blksize > 0 && c->shmem_size % st.st_blksize)
+  {
+    c->shmem_size += st.st_blksize - c->shmem_size % st.st_blksize;
+  }
+  c->shmem = mmap(NULL, c->shmem_size, PROT_READ|PROT_WRITE, MAP_SHARED, memfd, 0);
+  close(memfd);
+  if (c->shmem == MAP_FAILED)
+  {
+    c->shmem = NULL;
+    return false;
+  }
+  return true;
+}
+
+void * sdlux_back_buffer (SdluxClient * c)
+{
+  if (!c->shmem) return NULL;
+  return (char*)c->shmem + (size_t)c->back * c->pitch * c->h;
+}
+
+bool sdlux_draw (SdluxClient * c, bool flip)
+{
+  DrawMsg m = {};
+  m.flip = flip;
+  if (!sdlux_send(c, Draw, &m, sizeof(m))) return false;
+  if (flip && c->buffers != 3) c->flip_wait = true;
+  if (c->sync && c->buffers == 3) c->flip_wait = true;
+  return true;
+}
+
+bool sdlux_draw_rects (SdluxClient * c, bool flip, int count, const SDL_Rect * rects)
+{
+  char buf[sizeof(DrawRectsMsg) + count * sizeof(SDL_Rect)];
+  DrawRectsMsg * m = (void*)buf;
+  memset(m, 0, sizeof(*m));
+  m->version = SDLUX_DRAWRECTS_VERSION;
+  m->flip = flip;
+  m->count = count;
+  memcpy(m->rects, rects, count * sizeof(SDL_Rect));
+  if (!sdlux_send(c, DrawRects, buf, sizeof(buf))) return false;
+  if (flip && c->buffers != 3) c->flip_wait = true;
+  if (c->sync && c->buffers == 3) c->flip_wait = true;
+  return true;
+}
+
+bool sdlux_set_palette (SdluxClient * c, int first, int count, const SDL_Color * colors)
+{
+  char buf[sizeof(SetPaletteMsg) + count * sizeof(SDL_Color)];
+  SetPaletteMsg * m = (void*)buf;
+  m->first = first;
+  m->count = count;
+  memcpy(m->colors, colors, count * sizeof(SDL_Color));
+  return sdlux_send(c, SetPalette, buf, sizeof(buf));
+}
+
+bool sdlux_set_caption (SdluxClient * c, const char * caption)
+{
+  return sdlux_send(c, WM_SetCaption, caption, strlen(caption) + 1);
+}
+
+bool sdlux_warp_mouse (SdluxClient * c, int x, int y)
+{
+  WarpMouseMsg m = {x, y};
+  return sdlux_send(c, WarpMouse, &m, sizeof(m));
+}
+
+static int wait_cursor_added (SdluxClient * c)
+{
+  static char rbuf[4096];
+  while (true)
+  {
+    int r = sdlux_recv(c, rbuf, sizeof(rbuf), true);
+    if (r < 0) return -1;
+    if (*(int32_t*)rbuf != CursorAdded || r < 4 + sizeof(CursorAddedMsg)) continue;
+    return ((CursorAddedMsg*)(rbuf + 4))->index;
+  }
+}
+
+int sdlux_add_cursor (SdluxClient * c, int w, int h, int hotx, int hoty, const uint8_t * data, const uint8_t * mask)
+{
+  int size = w / 8 * h;
+  char buf[sizeof(AddCursorMsg) + 2 * size];
+  AddCursorMsg * m = (void*)buf;
+  m->w = w;
+  m->h = h;
+  m->hotx = hotx;
+  m->hoty = hoty;
+  memcpy(m->data, data, size);
+  memcpy(m->data + size, mask, size);
+  if (!sdlux_send(c, AddCursor, buf, sizeof(buf))) return -1;
+  return wait_cursor_added(c);
+}
+
+int sdlux_add_color_cursor (SdluxClient * c, int w, int h, int hotx, int hoty, const uint32_t * pixels)
+{
+  if (w <= 0 || h <= 0 || w > 64 || h > 64) return -1;
+  int size = w * h * 4;
+  char buf[sizeof(AddColorCursorMsg) + size];
+  AddColorCursorMsg * m = (void*)buf;
+  m->w = w;
+  m->h = h;
+  m->hotx = hotx;
+  m->hoty = hoty;
+  memcpy(m->data, pixels, size);
+  if (!sdlux_send(c, AddColorCursor, buf, sizeof(buf))) return -1;
+  return wait_cursor_added(c);
+}
+
+bool sdlux_manage_cursor (SdluxClient * c, int op, int index)
+{
+  ManageCursorMsg m = {op, index};
+  return sdlux_send(c, ManageCursor, &m, sizeof(m));
+}
+
+bool sdlux_set_event_mask (SdluxClient * c, uint32_t mask)
+{
+  SetEventMaskMsg m = {mask};
+  return sdlux_send(c, SetEventMask, &m, sizeof(m));
+}
+
+bool sdlux_set_present_sync (SdluxClient * c, bool enable)
+{
+  SetPresentSyncMsg m = {enable};
+  if (!sdlux_send(c, SetPresentSync, &m, sizeof(m))) return false;
+
+  static char buf[4096];
+  PresentSyncSetMsg * ps = (void*)(buf + 4);
+  while (true)
+  {
+    int r = sdlux_recv(c, buf, sizeof(buf), true);
+    if (r < 0) return false;
+    if (*(int32_t*)buf == PresentSyncSet && r >= 4 + sizeof(*ps)) break;
+  }
+
+  close_sync(c);
+  if (!ps->success) return false;
+  if (!enable) return true;
+  if (c->recv_fds[0] < 0) return false;
+
+  void * mem = mmap(NULL, sizeof(PresentSyncShared), PROT_READ|PROT_WRITE, MAP_SHARED, c->recv_fds[0], 0);
+  close(c->recv_fds[0]);
+  c->recv_fds[0] = -1;
+  if (mem == MAP_FAILED) return false;
+  c->sync = mem;
+  c->sync_seq = 0;
+  return true;
+}
+
+bool sdlux_check_present (SdluxClient * c, bool block)
+{
+  if (!c->sync || !c->flip_wait) return !c->flip_wait;
+  while (true)
+  {
+    uint32_t seq = __atomic_load_n(&c->sync->seq, __ATOMIC_ACQUIRE);
+    if (seq != c->sync_seq)
+    {
+      c->sync_seq = seq;
+      // It may be left over from a video mode with more buffers
+      int back = __atomic_load_n(&c->sync->back, __ATOMIC_RELAXED);
+      if (back >= 0 && back < c->buffers) c->back = back;
+      c->flipped.frame = __atomic_load_n(&c->sync->frame, __ATOMIC_RELAXED);
+      c->flipped.interval = __atomic_load_n(&c->sync->interval, __ATOMIC_RELAXED);
+      c->flipped.dropped = __atomic_load_n(&c->sync->dropped, __ATOMIC_RELAXED);
+      c->flipped.present_time = __atomic_load_n(&c->sync->present_time, __ATOMIC_RELAXED);
+      c->flip_wait = false;
+      return true;
+    }
+    if (!block) return false;
+
+    // Pairs with the server bumping seq and then checking waiting
+    __atomic_store_n(&c->sync->waiting, 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    bool timed_out = false;
+    if (__atomic_load_n(&c->sync->seq, __ATOMIC_RELAXED) == seq)
+    {
+      struct timespec ts = {0, 100000000};
+      timed_out = syscall(SYS_futex, &c->sync->seq, FUTEX_WAIT, seq, &ts, NULL, 0) && errno == ETIMEDOUT;
+    }
+    __atomic_store_n(&c->sync->waiting, 0, __ATOMIC_RELAXED);
+
+    // Don't wait forever if the server has gone away
+    struct pollfd pfd = {c->fd, 0, 0};
+    if (timed_out && poll(&pfd, 1, 0) != 0) return false;
+  }
+}
+
+bool sdlux_set_event_ring (SdluxClient * c, int size)
+{
+  SetEventRingMsg m = {size};
+  if (!sdlux_send(c, SetEventRing, &m, sizeof(m))) return false;
+
+  static char buf[4096];
+  EventRingSetMsg * rs = (void*)(buf + 4);
+  while (true)
+  {
+    int r = sdlux_recv(c, buf, sizeof(buf), true);
+    if (r < 0) return false;
+    if (*(int32_t*)buf == EventRingSet && r >= 4 + sizeof(*rs)) break;
+  }
+
+  // The server has let go of the old ring (if any) by now
+  close_ring(c);
+  if (!rs->success || c->recv_fds[0] < 0 || c->recv_fds[1] < 0) return false;
+
+  c->ring_mem_size = sizeof(SpscShared) + rs->size;
+  c->ring_mem = mmap(NULL, c->ring_mem_size, PROT_READ|PROT_WRITE, MAP_SHARED, c->recv_fds[0], 0);
+  close(c->recv_fds[0]);
+  c->recv_fds[0] = -1;
+  c->ring_bell = c->recv_fds[1];
+  c->recv_fds[1] = -1;
+  if (c->ring_mem == MAP_FAILED)
+  {
+    c->ring_mem = NULL;
+    close_ring(c);
+    return false;
+  }
+  spsc_attach(&c->ring, c->ring_mem, rs->size);
+  return true;
+}
+
+int sdlux_recv_ring (SdluxClient * c, void * buf, int size)
+{
+  if (!c->ring_mem) return 0;
+  uint32_t len;
+  void * rec = spsc_front(&c->ring, &len);
+  if (!rec) return 0;
+  if (len > size) len = size;
+  memcpy(buf, rec, len);
+  spsc_pop(&c->ring);
+  return len;
+}
+
+// Turns an event message into an SDL_Event.  Returns 1 if it was one, 0 if
+// it was some other message, or -1 if it was too short.
+static int decode_event (const char * buf, int r, SDL_Event * ev)
+{
+  const void * body = buf + 4;
+  memset(ev, 0, sizeof(*ev));
+  switch (*(int32_t*)buf)
+  {
+#define EVENT(T, field) \
+    case T: \
+      if (r < 4 + sizeof(T##Msg)) return -1; \
+      ev->field = ((T##Msg*)body)->event; \
+      return 1;
+    EVENT(KeyEvent, key)
+    EVENT(MouseButtonEvent, button)
+    EVENT(MouseMoveEvent, motion)
+    EVENT(ResizedEvent, resize)
+    EVENT(ActiveEvent, active)
+#undef EVENT
+    case QuitEvent:
+      ev->type = SDL_QUIT;
+      return 1;
+  }
+  return 0;
+}
+
+int sdlux_poll_event (SdluxClient * c, SDL_Event * ev, bool block)
+{
+  static char buf[4096];
+  while (true)
+  {
+    int r = sdlux_recv_ring(c, buf, sizeof(buf));
+    if (r > 0) return decode_event(buf, r, ev);
+
+    // With a ring, wait on its eventfd as well as the socket
+    bool ring_idle = c->ring_mem && spsc_idle(&c->ring);
+    if (c->ring_mem && !ring_idle) continue;
+    if (block && ring_idle)
+    {
+      struct pollfd pfds[2] = {{c->fd, POLLIN, 0}, {c->ring_bell, POLLIN, 0}};
+      if (poll(pfds, 2, -1) < 0 && errno != EINTR) return -1;
+      eventfd_t n;
+      if (pfds[1].revents & POLLIN) eventfd_read(c->ring_bell, &n);
+      if (!(pfds[0].revents & (POLLIN | POLLHUP | POLLERR))) continue;
+    }
+
+    r = sdlux_recv(c, buf, sizeof(buf), block && !ring_idle);
+    if (r == 0 && ring_idle && block) continue;
+    if (r <= 0) return r;
+    r = decode_event(buf, r, ev);
+    if (r) return r;
+  }
+}
@@ -0,0 +1,124 @@
+#ifndef SDLUXER_CLIENT_H
+#define SDLUXER_CLIENT_H
+
+// A minimal client for the SDLuxer protocol, for tools which want to talk
+// to the server without going through SDL.
+
+#include <SDL/SDL.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "sdluxer.h"
+#include "spsc.h"
+
+typedef struct SdluxClient
+{
+  int fd;
+
+  // From VideoModeSet
+  int w;
+  int h;
+  int pitch;
+  int depth;
+  int buffers; // 1, 2 or 3 (mailbox)
+  void * shmem;
+  size_t shmem_size;
+
+  int back; // The buffer to draw into
+  bool flip_wait; // Waiting for a Flipped
+  FlippedMsg flipped; // From the last one (all zero from older servers)
+  int recv_fds[2]; // Last fds the server passed us which haven't been used, or -1
+
+  // From EventRingSet
+  void * ring_mem; // NULL if events come over the socket
+  size_t ring_mem_size;
+  Spsc ring;
+  int ring_bell; // eventfd the server writes when the ring stops being empty
+
+  // From PresentSyncSet
+  PresentSyncShared * sync; // NULL if flips are told by message
+  uint32_t sync_seq; // Its seq when we last looked
+} SdluxClient;
+
+// Connects to the server at path (or $SDLUXER_SERVER if path is NULL)
+bool sdlux_connect (SdluxClient * c, const char * path);
+
+void sdlux_close (SdluxClient * c);
+
+// Sends a message.  data is the message struct (without the type), and
+// size is its size including any trailing variable-length data.
+bool sdlux_send (SdluxClient * c, MsgType type, const void * data, int size);
+
+// Reads one message into buf (which includes the 32 bit type at the start)
+// and returns its length, 0 if block is false and nothing was waiting, or
+// -1 on error or disconnect.  Flipped and NextBuffer are also acted on
+// here, so that back, flip_wait and flipped stay current.
+int sdlux_recv (SdluxClient * c, void * buf, int size, bool block);
+
+// Sets the video mode, and maps the shared memory.  Messages which arrive
+// while waiting for the reply are discarded.
+bool sdlux_set_video_mode (SdluxClient * c, int w, int h, int depth, bool double_buf, int buffers);
+
+// Where to draw the next frame
+void * sdlux_back_buffer (SdluxClient * c);
+
+// Sends a Draw.  With flip, double-buffered clients must then wait for
+// flip_wait to clear before drawing again.  With present sync, so must
+// mailbox clients, after any Draw.
+bool sdlux_draw (SdluxClient * c, bool flip);
+
+// Like sdlux_draw, but only the given rectangles changed
+bool sdlux_draw_rects (SdluxClient * c, bool flip, int count, const SDL_Rect * rects);
+
+// For 8 bit modes
+bool sdlux_set_palette (SdluxClient * c, int first, int count, const SDL_Color * colors);
+
+bool sdlux_set_caption (SdluxClient * c, const char * caption);
+
+bool sdlux_warp_mouse (SdluxClient * c, int x, int y);
+
+// Uploads a cursor (in SDL_CreateCursor's format) and returns its index, or
+// -1 on error.  Like sdlux_set_video_mode, this discards messages which
+// arrive while waiting for the reply.
+int sdlux_add_cursor (SdluxClient * c, int w, int h, int hotx, int hoty, const uint8_t * data, const uint8_t * mask);
+
+// The same, but for a color cursor of w*h ARGB pixels (up to 64x64)
+int sdlux_add_color_cursor (SdluxClient * c, int w, int h, int hotx, int hoty, const uint32_t * pixels);
+
+// op is one of ManageCursorOps
+bool sdlux_manage_cursor (SdluxClient * c, int op, int index);
+
+// Asks for flips to be told through shared memory rather than by message
+// (see SetPresentSyncMsg), or with enable false, goes back to messages.
+// Discards messages while waiting for the reply, like sdlux_set_video_mode.
+bool sdlux_set_present_sync (SdluxClient * c, bool enable);
+
+// With present sync, checks whether the server has taken the last frame,
+// and if so, clears flip_wait and updates back and flipped.  With block, sleeps until
+// it has.  Returns false if flip_wait is still set.  Without present sync,
+// this just checks flip_wait; sdlux_recv does the work.
+bool sdlux_check_present (SdluxClient * c, bool block);
+
+// Asks for events to come through a ring in shared memory (see
+// SetEventRingMsg), size bytes big or 0 for the default.  Like
+// sdlux_set_video_mode, this discards messages which arrive while waiting
+// for the reply.
+bool sdlux_set_event_ring (SdluxClient * c, int size);
+
+// Says which input events to send (an OR of their MsgTypes; see
+// SetEventMaskMsg)
+bool sdlux_set_event_mask (SdluxClient * c, uint32_t mask);
+
+// Copies the next event message (type and all) out of the event ring into
+// buf, and returns its length, or 0 if the ring is empty or there isn't one.
+// Anything in the ring came before any event still in the socket.
+int sdlux_recv_ring (SdluxClient * c, void * buf, int size);
+
+// Gets the next input event as an SDL_Event.  Returns 1 if there was one,
+// 0 if block is false and there wasn't, or -1 on error or disconnect.
+// Other messages are handled as by sdlux_recv and then dropped.  Events in
+// the event ring, if there is one, are taken first.
+int sdlux_poll_event (SdluxClient * c, SDL_Event * ev, bool block);
+
+#endif
@@ -1,17 +1,33 @@
 #define _GNU_SOURCE
 #include <SDL/SDL.h>
+#include <SDL/SDL_syswm.h>
 #include "lux.h"
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/socket.h>
 #include <sys/mman.h>
 #include <sys/un.h>
+#include <sys/time.h>
+#include <sys/resource.h>
 #include <unistd.h>
-#include <poll.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
+#include <linux/futex.h>
+#include <pthread.h>
+#include <sched.h>
 #include <errno.h>
 #include <signal.h>
+#include <stddef.h>
 
 #include "sdluxer.h"
+#include "blit.h"
+#include "framesched.h"
+#include "stats.h"
+#include "shmbuf.h"
+#include "workpool.h"
+#include "spsc.h"
+#include "record.h"
 
 #define LOG(level, fmt, ...)
 #define LOG_INFO(fmt, ...)
@@ -47,402 +63,2389 @@ struct ObufType
 static struct ObufType obuf; // Temporary space for sending packets
 
 
-static bool quitting = false;
+static volatile bool quitting = false; // Also set by handle_sigint()
+
+// Our own windows other than clients' (About boxes and the switcher).
+// We don't keep track of where they've been, so clients' windows are
+// drawn in full while there are any, and after one closes (see
+// sdl_draw_handler()).
+static Window ** own_windows = NULL;
+static int num_own_windows = 0;
+static int max_own_windows = 0;
+static unsigned int own_windows_closed = 0;
+
+// Returns false (having closed it) if we can't keep track of it
+static bool own_window_opened (Window * w)
+{
+  if (num_own_windows == max_own_windows)
+  {
+    int max = max_own_windows ? max_own_windows * 2 : 4;
+    Window ** nw = realloc(own_windows, max * sizeof(*nw));
+    if (!nw)
+    {
+      window_close(w);
+      return false;
+    }
+    own_windows = nw;
+    max_own_windows = max;
+  }
+  own_windows[num_own_windows++] = w;
+  return true;
+}
+
+static void own_window_closed (Window * w)
+{
+  for (int i = 0; i < num_own_windows; i++)
+  {
+    if (own_windows[i] != w) continue;
+    own_windows[i] = own_windows[--num_own_windows];
+    own_windows_closed++;
+    return;
+  }
+}
 
 static int screen_width = 640, screen_height = 480;
 
-static bool parse_dimensions (const char * d, int * ww, int * hh)
-{
-  int w = *ww, h = *hh;
-  if (sscanf(d, "%i,%i", &w, &h) != 2)
+static bool parse_dimensions (const char * d, int * ww, int * hh)
+{
+  int w = *ww, h = *hh;
+  if (sscanf(d, "%i,%i", &w, &h) != 2)
+  {
+    if (sscanf(d, "%ix%i", &w, &h) != 2)
+    {
+      return false;
+    }
+  }
+
+  if (w < 20) w = 20;
+  if (h < 10) h = 10;
+
+  *ww = w; *hh = h;
+
+  return true;
+}
+
+
+static void about_key_handler (Window * w, SDL_keysym * k, bool down)
+{
+  if (k->unicode == 'q' || k->unicode == 'Q') quitting = true;
+}
+
+static void about_close_handler (Window * w)
+{
+  w->on_close = NULL;
+  own_window_closed(w);
+  window_close(w);
+}
+
+void about_click_handler (Window * w, int x, int y, int buttons, int type, bool raised)
+{
+  about_close_handler(w);
+}
+
+bool about_draw_handler (Window * w, SDL_Surface * scr, SDL_Rect r)
+{
+  window_clear_client(w, w->bg_color);
+  text_draw(scr, "SDLuxer by Murphy McCauley\n\nPress 'Q' to quit.", r.x, r.y, 0xffFFffFF);
+  return true;
+}
+
+static void f1_handler (FKey * fkey)
+{
+  Window * w = window_create(200, lux_sysfont_h()*3, "SDLuxer", 0);
+  w->on_mousedown = about_click_handler;
+  w->bg_color = lux_get_theme().win.face;
+  w->on_draw = about_draw_handler;
+  w->on_keydown = about_key_handler;
+  w->on_close = about_close_handler;
+  own_window_opened(w);
+}
+
+// Triple buffering, for mailbox mode
+#define SDLUX_MAX_BUFFERS 3
+
+// If a client damages more than this many separate rectangles in a frame,
+// we just merge them all into their bounding box.
+#define SDLUX_MAX_DAMAGE 16
+
+// Most separate pieces we'll track of a partly covered window; past this,
+// we just act as if it weren't covered at all.
+#define SDLUX_MAX_EXPOSED 16
+
+// A window which is entirely covered gets at most this many frames a
+// second (i.e., its Flipped replies are held back), since nobody can see
+// them anyway.
+#define SDLUX_HIDDEN_FPS 4
+
+// Biggest color cursor we'll take (see AddColorCursorMsg)
+#define SDLUX_MAX_COLOR_CURSOR 64
+
+// Size of each cell in the window switcher (see switcher_open())
+#define SDLUX_THUMB_W 160
+#define SDLUX_THUMB_H 120
+#define SDLUX_THUMB_GAP 8
+
+// Most fds that go to the client with one message (see SetEventRingMsg)
+#define SDLUX_MAX_PASS_FDS 2
+
+// Size of a client's event ring (see SetEventRingMsg)
+#define SDLUX_DEFAULT_EVENT_RING (64*1024)
+#define SDLUX_MAX_EVENT_RING (1024*1024)
+
+typedef struct
+{
+  int w, h;
+  int hotx, hoty;
+  Uint32 pixels[0]; // ARGB
+} ColorCursor;
+
+// A cursor a client has added is one or the other
+typedef struct
+{
+  SDL_Cursor * sdl;
+  ColorCursor * color;
+} SessionCursor;
+
+// Fds to pass along with a queued message (see io_send_fd())
+typedef struct
+{
+  int at; // Ring position of the message
+  int fds[SDLUX_MAX_PASS_FDS]; // Unused ones are -1
+} PassFds;
+
+// Biggest width or height we'll give a client, which also keeps the size of
+// its buffers comfortably inside an int
+#define SDLUX_MAX_SIZE 8192
+
+// Sockets are handled by an I/O thread, and everything to do with SDL and
+// Lux by the render (main) thread, so that neither has to wait for the
+// other.  The two talk through a pair of queues of Cmds.  Each half of a
+// Session belongs to one thread, and the other thread doesn't touch it
+// (except to read a few counters for stats).
+typedef struct Session_tag
+{
+  // Render thread
+
+  Window * wnd;
+  SDL_Surface * surfs[SDLUX_MAX_BUFFERS]; // One per buffer in fb
+  int num_buffers;
+  int front; // The buffer we're showing
+  bool swap_pending; // Double buffered: show the other buffer next frame
+  bool mailbox; // Triple buffered (see NextBufferMsg)
+  int pending; // Mailbox: newest complete frame not yet shown, or -1
+  int back; // Mailbox: the buffer the client is drawing into
+  uint64_t frames_dropped; // Replaced before they were shown
+  uint64_t frames_shown;
+  uint64_t draws;
+  uint64_t draw_time; // When the oldest Draw not yet shown came in (us)
+  Histogram draw_latency; // From Draw to its frame being on the screen (us)
+  ShmBuf fb; // Holds the buffers
+
+  int index; // Position in sessions
+  bool closed; // Torn down; we just ignore anything else from the client
+  bool hung_up; // The I/O thread has let go of it
+  bool flip_wait;
+  bool do_draw; // If set, we're on draw_queue
+  struct Session_tag * next_draw;
+  struct Session_tag * next_shown; // In the frame being drawn (see main_loop())
+  int num_cursors;
+  SessionCursor * cursors;
+  ColorCursor * color_cursor; // If set, we draw it (see overlay)
+  bool cursor_hidden;
+
+  // Damage accumulated since the window was last drawn
+  bool damage_full;
+  int num_damage;
+  SDL_Rect damage[SDLUX_MAX_DAMAGE];
+  SDL_Rect drawn_rect; // Where the window was last drawn on screen
+  unsigned int drawn_closed; // own_windows_closed when it was
+
+  // What of the window can be seen (see update_visibility())
+  uint64_t raised; // When it was last raised, for working out the stacking
+  bool hidden; // Entirely covered (or off the screen)
+  bool exposed_all; // Not covered at all
+  int num_exposed;
+  SDL_Rect exposed[SDLUX_MAX_EXPOSED]; // Otherwise, the visible parts
+  uint64_t hidden_next_frame; // When a hidden window can have a frame (us)
+  bool frame_held; // Its frame is waiting for hidden_next_frame
+
+  // Thumbnail for the window switcher, and what's changed since we last
+  // updated it (see update_thumb())
+  SDL_Surface * thumb;
+  int thumb_factor;
+  bool thumb_dirty;
+  bool thumb_full;
+  SDL_Rect thumb_damage;
+
+  // Where input events go, if the client asked (see SetEventRingMsg)
+  ShmBuf ring_mem;
+  Spsc ring;
+  int ring_bell; // eventfd for when the ring stops being empty; -1 if no ring
+  bool ring_overflowed; // So events go over the socket until there's a new ring
+  uint32_t event_mask; // The event MsgTypes it wants (see SetEventMaskMsg)
+
+  RecordShadow rec_shadow; // What it last drew in each buffer, if we're recording
+
+  // Where Flipped and NextBuffer go instead, if the client asked (see
+  // SetPresentSyncMsg)
+  ShmBuf sync_mem;
+  uint32_t sync_seq; // Our own copy, since the client can write to it
+
+  // I/O thread
+
+  int fd;
+  unsigned int id; // Unique for the life of the server, for stats
+  bool io_closed; // Socket closed, and the render thread has been told
+
+  // Outgoing messages which haven't been sent yet (see queue_message())
+  char * oring;
+  int oring_head; // Next message to send
+  int oring_tail; // Where the next message goes
+  int oring_bytes; // Queued bytes, including sizes and padding
+  int oring_peak; // Most oring_bytes has ever been
+  bool out_blocked; // Socket is full, so wait for EPOLLOUT
+  bool out_queued; // If set, we're on out_queue
+  struct Session_tag * next_out;
+  // Fds for queued messages, oldest first.  There can't be more than
+  // there are messages in the ring.
+  PassFds * pass;
+  int num_pass;
+  int max_pass;
+
+  // Motion we haven't queued yet, so that more can be merged into it
+  bool motion_pending;
+  MouseMoveEventMsg motion;
+
+  // Reading stops while the render thread's queue is full
+  bool read_stalled;
+  bool hup_pending; // Hung up while stalled; close once it's all read
+  struct Session_tag * next_stalled;
+  char * backlog; // Messages we read but couldn't queue (see read_session())
+  int backlog_len;
+
+  // For stats; written with stat_add() so the render thread can read them
+  uint64_t msgs_in;
+  uint64_t bytes_in;
+  uint64_t msgs_out;
+  uint64_t bytes_out;
+} Session;
+
+// Counters which one thread writes and the other reads for stats.  Only
+// the owning thread ever writes, so this doesn't need to be an atomic
+// increment; it just needs to not tear.
+static inline void stat_add (uint64_t * c, uint64_t n)
+{
+  __atomic_store_n(c, *c + n, __ATOMIC_RELAXED);
+}
+
+static inline uint64_t stat_get (const uint64_t * c)
+{
+  return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+static inline int stat_get_int (const int * c)
+{
+  return __atomic_load_n(c, __ATOMIC_RELAXED);
+}
+
+static inline void store_int (int * c, int v)
+{
+  __atomic_store_n(c, v, __ATOMIC_RELAXED);
+}
+
+// Sessions are allocated individually (Lux windows and epoll hold pointers
+// to them), and the table just lets the render thread find all of them.
+// It grows as needed and has no relation to file descriptor numbers.
+Session ** sessions = NULL;
+int num_sessions = 0;
+int max_sessions = 0;
+
+// What goes through the queues between the threads.  A session is freed
+// only once both threads are done with it: the I/O thread says so with
+// CmdHangup (after which it never mentions the session again), and the
+// render thread answers with CmdRelease (ditto), which is when it's freed.
+typedef enum
+{
+  // I/O thread to render thread
+  CmdOpen, // A new session
+  CmdMessage, // A message from the client (in data)
+  CmdHangup, // The socket is closed
+  // Render thread to I/O thread
+  CmdSend, // A message for the client (in data)
+  CmdSendFd, // ...along with fds, which the I/O thread then owns
+  CmdMotion, // A MouseMoveEventMsg, which may be merged with others
+  CmdClose, // Close the socket (after sending what's queued)
+  CmdRelease, // Free the session
+} CmdKind;
+
+typedef struct
+{
+  Session * s;
+  CmdKind kind;
+  int fds[SDLUX_MAX_PASS_FDS]; // CmdSendFd only; unused ones are -1
+  int length; // Of data
+  char data[0];
+} Cmd;
+
+// Size of each queue; it has to be able to hold a few of the largest messages
+#define SDLUX_QUEUE_SIZE (1024*1024)
+
+static Spsc to_render;
+static Spsc to_io;
+
+// Each thread sleeps in its own epoll_wait(), and these wake them up
+static int render_wake_fd = -1;
+static int io_wake_fd = -1;
+static char wake_marker; // epoll data.ptr for either
+
+// Set by the I/O thread when it stopped reading because to_render was
+// full, so the render thread knows to wake it once there's room.
+static int io_waiting_for_room = 0;
+
+// How many epoll events we handle per wakeup
+#define SDLUX_EPOLL_BATCH 64
+
+// Largest message we'll accept from a client.  Anything bigger gets
+// truncated by the socket, which we treat as a protocol error.
+#define SDLUX_MAX_MESSAGE (64*1024)
+
+// Default number of messages we try to read per recvmmsg() call
+#define SDLUX_DEFAULT_RECV_BATCH 16
+
+// Since we use SOCK_SEQPACKET, every read gets exactly one whole message,
+// and we handle them all before reading from anyone else.  So one set of
+// receive buffers can be shared by all the sessions.
+static int recv_batch = SDLUX_DEFAULT_RECV_BATCH;
+static struct mmsghdr * recv_msgs = NULL;
+static struct iovec * recv_iovs = NULL;
+static char * recv_arena = NULL;
+
+// Leave room for a terminating NUL, and keep each slot aligned
+#define RECV_SLOT_SIZE ((SDLUX_MAX_MESSAGE + 1 + 15) & ~15)
+
+int epoll_fd = -1; // Render thread
+int io_epoll_fd = -1;
+int listen_fd = -1;
+
+// The fd SDL gets input from, if we know it (-1 otherwise).  With it in our
+// epoll set, we can sleep until there's input instead of polling SDL.
+int input_fd = -1;
+static char input_marker; // epoll data.ptr for input_fd
+
+static bool headless = false;
+
+// Framebuffer memory options (see shmbuf_set_options())
+static bool huge_pages = false;
+static bool prefault = false;
+
+// Threads to split big blits across (see workpool.h)
+static int blit_threads = 1;
+
+// Where to record what clients send, if anywhere (see record.h)
+static char * record_path = NULL;
+static bool recording = false;
+
+static void record_failed (void)
+{
+  LOG_ERROR("Couldn't write recording (errno:%i); stopping", errno);
+  record_stop();
+  recording = false;
+}
+
+static FrameSched sched;
+static int frame_rate = 60;
+static bool immediate_present = false;
+
+// Sessions which have submitted a frame since the last one we drew
+Session * draw_queue = NULL;
+
+// For stacking order; bumped whenever a window is created or raised
+static uint64_t raise_count = 0;
+static int num_hidden = 0; // Sessions whose windows are entirely covered
+static uint64_t held_until = 0; // When the first held frame is due, or 0
+
+// Sessions with queued outgoing messages (I/O thread)
+Session * out_queue = NULL;
+
+// Sessions whose reading is stalled (I/O thread)
+Session * stalled_sessions = NULL;
+
+// Most messages we hand to a single sendmmsg()
+#define SDLUX_SEND_BATCH 64
+
+// Once a session has this many bytes waiting to be sent, we stop sending
+// it motion (it just keeps being merged until the backlog clears).  The
+// ring is a few times bigger, and a session which fills it is dropped.
+#define SDLUX_DEFAULT_OUT_HIGH_WATER (64*1024)
+#define SDLUX_OUT_RING_FACTOR 4
+static int out_high_water = SDLUX_DEFAULT_OUT_HIGH_WATER;
+static int out_ring_size = SDLUX_DEFAULT_OUT_HIGH_WATER * SDLUX_OUT_RING_FACTOR;
+
+// Render thread
+struct
+{
+  uint64_t frames;
+  uint64_t sessions_drawn; // Total over all frames
+  int last_sessions_drawn; // In the most recent frame
+  uint64_t motion_events; // From Lux
+  uint64_t blits_fast; // Straight copies from client memory to the screen
+  uint64_t blits_slow; // ...and ones which had to go through SDL
+  uint64_t blits_culled; // Window draws skipped because it was covered
+  uint64_t frames_delayed; // Frames held back because a window was covered
+  uint64_t cursor_draws; // Times we moved or redrew a color cursor
+  uint64_t thumb_updates; // Times a switcher thumbnail was brought up to date
+  uint64_t thumb_pixels; // Client pixels shrunk for them
+  uint64_t ring_events; // Events put in clients' event rings
+  uint64_t ring_bells; // Times we had to wake a client up for them
+  uint64_t ring_overflows; // Event rings which filled up
+  uint64_t events_masked; // Events not sent because the client didn't want them
+  uint64_t sync_presents; // Flips told to clients through shared memory
+  uint64_t sync_wakes; // ...which needed a futex wake
+  uint64_t frames_dropped; // Client frames replaced before being shown
+  uint64_t fb_allocated; // Video mode changes which needed new memory
+  uint64_t fb_reused; // ...and ones which could keep what they had
+  uint64_t fb_huge; // New memory which got explicit huge pages
+  uint64_t frame_faults; // Minor page faults taken in lux_draw() (render thread and blit workers)
+  uint64_t wakeups; // Returns from epoll_wait()
+  uint64_t timeouts; // ...which had no events
+  uint64_t queue_waits; // Times to_io was full and we had to wait
+  Histogram frame_time; // Time spent in lux_draw() (us)
+  Histogram draw_latency; // From Draw to its frame being on the screen (us)
+} stats;
+
+// I/O thread; written with stat_add()
+struct
+{
+  uint64_t msgs_in;
+  uint64_t motion_merged; // Motion merged into an earlier one
+  uint64_t send_calls; // sendmmsg() calls
+  uint64_t msgs_sent;
+  uint64_t motion_deferred; // Times motion was held back by backpressure
+  uint64_t overflow_closes; // Sessions dropped because their ring filled
+  uint64_t read_stalls; // Times to_render was full and we stopped reading
+  uint64_t wakeups; // Returns from epoll_wait()
+} io_stats;
+
+// Where to serve stats (see serve_stats()), if anywhere
+char * stats_sock_name = NULL;
+int stats_fd = -1;
+static char stats_marker; // epoll data.ptr for stats_fd
+
+
+char * listen_sock_name = NULL;
+
+static void wake (int fd)
+{
+  uint64_t one = 1;
+  while (write(fd, &one, sizeof(one)) < 0 && errno == EINTR) {}
+}
+
+static void clear_wake (int fd)
+{
+  uint64_t n;
+  while (read(fd, &n, sizeof(n)) < 0 && errno == EINTR) {}
+}
+
+
+// ---- I/O thread ----
+
+static void io_close_session (Session * s);
+
+// Set when we've queued anything for the render thread since we last woke it
+static bool to_render_pushed = false;
+
+// Queues a Cmd for the render thread, or returns false if there's no room.
+// Messages get room for a terminating NUL and to be zero-extended to a
+// full SetVideoModeMsg (see handle_message()).
+static bool to_render_push (Session * s, CmdKind kind, const void * data, int length)
+{
+  int room = length;
+  if (kind == CmdMessage)
+  {
+    room = length + 1;
+    if (room < 4 + sizeof(SetVideoModeMsg)) room = 4 + sizeof(SetVideoModeMsg);
+  }
+  Cmd * c = spsc_reserve(&to_render, sizeof(Cmd) + room);
+  if (!c)
+  {
+    // Ask the render thread to wake us once it has made some room
+    __atomic_store_n(&io_waiting_for_room, 1, __ATOMIC_RELEASE);
+    wake(render_wake_fd);
+    return false;
+  }
+  c->s = s;
+  c->kind = kind;
+  c->length = length;
+  if (length) memcpy(c->data, data, length);
+  if (room > length) memset(c->data + length, 0, room - length);
+  spsc_commit(&to_render);
+  to_render_pushed = true;
+  return true;
+}
+
+// CmdOpen and CmdHangup can't be dropped or left in a socket, so if they
+// don't fit, they wait here (in order) until they do.  Nothing else goes
+// to the render thread until they're through.
+typedef struct Control_tag
+{
+  Session * s;
+  CmdKind kind;
+  struct Control_tag * next;
+} Control;
+
+static Control * controls = NULL;
+static Control * controls_tail = NULL;
+
+static bool flush_controls (void)
+{
+  while (controls)
+  {
+    Control * c = controls;
+    if (!to_render_push(c->s, c->kind, NULL, 0)) return false;
+    controls = c->next;
+    if (!controls) controls_tail = NULL;
+    free(c);
+  }
+  return true;
+}
+
+static void to_render_control (Session * s, CmdKind kind)
+{
+  if (!controls && to_render_push(s, kind, NULL, 0)) return;
+  Control * c = malloc(sizeof(Control));
+  if (!c)
+  {
+    LOG_ERROR("Couldn't allocate control command");
+    exit(1);
+  }
+  c->s = s;
+  c->kind = kind;
+  c->next = NULL;
+  if (controls_tail) controls_tail->next = c;
+  else controls = c;
+  controls_tail = c;
+}
+
+#define ORING_ALIGN(n) (((n) + 3) & ~3)
+#define ORING_WRAP -1 // Size marking the rest of the ring as unused
+
+static void queue_out (Session * s)
+{
+  if (s->out_queued) return;
+  s->out_queued = true;
+  s->next_out = out_queue;
+  out_queue = s;
+}
+
+// Outgoing messages aren't sent right away.  They're kept back-to-back in
+// the session's ring, each preceded by its size, and send_queued() sends
+// as many as it can with one sendmmsg().  Messages never wrap; if one
+// doesn't fit at the end of the ring, it goes at the start.
+static bool queue_message (Session * s, const void * buf, int size)
+{
+  if (!s->oring)
+  {
+    s->oring = malloc(out_ring_size);
+    if (!s->oring)
+    {
+      LOG_ERROR("Couldn't allocate outgoing ring");
+      return false;
+    }
+  }
+
+  // Start from the beginning whenever we can, so we touch less memory
+  if (s->oring_bytes == 0) s->oring_head = s->oring_tail = 0;
+
+  int rec = 4 + ORING_ALIGN(size);
+  int at = -1;
+  if (s->oring_bytes == 0 || s->oring_tail > s->oring_head)
+  {
+    if (out_ring_size - s->oring_tail >= rec)
+    {
+      at = s->oring_tail;
+    }
+    else if (s->oring_head >= rec)
+    {
+      if (out_ring_size - s->oring_tail >= 4)
+      {
+        *(int32_t*)(s->oring + s->oring_tail) = ORING_WRAP;
+      }
+      at = 0;
+    }
+  }
+  else if (s->oring_head - s->oring_tail >= rec)
+  {
+    at = s->oring_tail;
+  }
+
+  if (at < 0)
+  {
+    LOG_WARN("Outgoing queue full on fd:%i; client isn't reading", s->fd);
+    stat_add(&io_stats.overflow_closes, 1);
+    return false;
+  }
+
+  *(int32_t*)(s->oring + at) = size;
+  memcpy(s->oring + at + 4, buf, size);
+  s->oring_tail = at + rec;
+  store_int(&s->oring_bytes, s->oring_bytes + rec);
+  if (s->oring_bytes > s->oring_peak) store_int(&s->oring_peak, s->oring_bytes);
+
+  queue_out(s);
+  return true;
+}
+
+// Unless forced, motion stays pending (and keeps merging) while the
+// session is backed up.
+static bool queue_motion (Session * s, bool force)
+{
+  if (!s->motion_pending) return true;
+  if (!force && s->oring_bytes > out_high_water)
+  {
+    stat_add(&io_stats.motion_deferred, 1);
+    return true;
+  }
+  s->motion_pending = false;
+  char buf[4 + sizeof(MouseMoveEventMsg)];
+  *(int32_t*)buf = MouseMoveEvent;
+  memcpy(buf + 4, &s->motion, sizeof(s->motion));
+  return queue_message(s, buf, sizeof(buf));
+}
+
+// Motion is merged with any other motion until the queue is flushed or
+// something else gets sent to the session.
+static void merge_motion (Session * s, const MouseMoveEventMsg * m)
+{
+  if (!s->motion_pending)
+  {
+    s->motion = *m;
+    s->motion_pending = true;
+    return;
+  }
+  stat_add(&io_stats.motion_merged, 1);
+  SDL_MouseMotionEvent * e = &s->motion.event;
+  int xrel = e->xrel + m->event.xrel;
+  int yrel = e->yrel + m->event.yrel;
+  e->xrel = xrel < -32768 ? -32768 : (xrel > 32767 ? 32767 : xrel);
+  e->yrel = yrel < -32768 ? -32768 : (yrel > 32767 ? 32767 : yrel);
+  e->state = m->event.state;
+  e->x = m->event.x;
+  e->y = m->event.y;
+}
+
+// Queues a message (which includes its type)
+static bool io_send (Session * s, const void * buf, int size)
+{
+  // Anything else has to go out after the motion that came before it
+  if (!queue_motion(s, true)) return false;
+  return queue_message(s, buf, size);
+}
+
+static void close_fds (int * fds)
+{
+  for (int i = 0; i < SDLUX_MAX_PASS_FDS; i++)
+  {
+    if (fds[i] >= 0) close(fds[i]);
+    fds[i] = -1;
+  }
+}
+
+// Like io_send(), but fds are passed along with the message, and then
+// closed
+static bool io_send_fd (Session * s, const void * buf, int size, int * fds)
+{
+  if (s->num_pass == s->max_pass)
+  {
+    int max = s->max_pass ? s->max_pass * 2 : 4;
+    PassFds * np = realloc(s->pass, max * sizeof(*np));
+    if (!np)
+    {
+      LOG_ERROR("Couldn't allocate fd queue for fd:%i", s->fd);
+      close_fds(fds);
+      return false;
+    }
+    s->pass = np;
+    s->max_pass = max;
+  }
+  if (!io_send(s, buf, size))
+  {
+    close_fds(fds);
+    return false;
+  }
+  PassFds * p = &s->pass[s->num_pass++];
+  memcpy(p->fds, fds, sizeof(p->fds));
+  p->at = s->oring_tail - (4 + ORING_ALIGN(size));
+  return true;
+}
+
+// Finds the message at pos in the ring, following a wrap if there is one
+static int oring_next (Session * s, int pos)
+{
+  if (out_ring_size - pos < 4) return 0;
+  if (*(int32_t*)(s->oring + pos) == ORING_WRAP) return 0;
+  return pos;
+}
+
+// Sends as much of the ring as the socket will take
+static bool send_queued (Session * s)
+{
+  static struct mmsghdr msgs[SDLUX_SEND_BATCH];
+  static struct iovec iovs[SDLUX_SEND_BATCH];
+  static int ends[SDLUX_SEND_BATCH];
+  static int fd_index[SDLUX_SEND_BATCH]; // Which message each s->pass went with
+  static union
+  {
+    char buf[CMSG_SPACE(sizeof(int) * SDLUX_MAX_PASS_FDS)];
+    struct cmsghdr align;
+  } fd_cmsg[SDLUX_SEND_BATCH];
+
+  while (s->oring_bytes && !s->out_blocked)
+  {
+    int n = 0;
+    int num_fd = 0; // How many of s->pass go out with this batch
+    int pos = s->oring_head;
+    int left = s->oring_bytes;
+    while (n < SDLUX_SEND_BATCH && left)
+    {
+      pos = oring_next(s, pos);
+      int size = *(int32_t*)(s->oring + pos);
+      iovs[n].iov_base = s->oring + pos + 4;
+      iovs[n].iov_len = size;
+      memset(&msgs[n], 0, sizeof(msgs[n]));
+      msgs[n].msg_hdr.msg_iov = &iovs[n];
+      msgs[n].msg_hdr.msg_iovlen = 1;
+      if (num_fd < s->num_pass && pos == s->pass[num_fd].at)
+      {
+        int * fds = s->pass[num_fd].fds;
+        int num_fds = 1;
+        while (num_fds < SDLUX_MAX_PASS_FDS && fds[num_fds] >= 0) num_fds++;
+        msgs[n].msg_hdr.msg_control = fd_cmsg[n].buf;
+        msgs[n].msg_hdr.msg_controllen = CMSG_SPACE(sizeof(int) * num_fds);
+        struct cmsghdr * c = CMSG_FIRSTHDR(&msgs[n].msg_hdr);
+        c->cmsg_level = SOL_SOCKET;
+        c->cmsg_type = SCM_RIGHTS;
+        c->cmsg_len = CMSG_LEN(sizeof(int) * num_fds);
+        memcpy(CMSG_DATA(c), fds, sizeof(int) * num_fds);
+        fd_index[num_fd++] = n;
+      }
+      pos += 4 + ORING_ALIGN(size);
+      left -= 4 + ORING_ALIGN(size);
+      ends[n] = pos;
+      n++;
+    }
+
+    int r = sendmmsg(s->fd, msgs, n, MSG_NOSIGNAL);
+    if (r == -1 && errno == EINTR) continue;
+    if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    {
+      // We'll get an EPOLLOUT edge when the socket drains
+      s->out_blocked = true;
+      break;
+    }
+    if (r == -1)
+    {
+      LOG_ERROR("sendmmsg() failed with errno:%i", errno);
+      return false;
+    }
+    stat_add(&io_stats.send_calls, 1);
+    stat_add(&io_stats.msgs_sent, r);
+    stat_add(&s->msgs_out, r);
+    int sent_bytes = 0;
+    for (int i = 0; i < r; i++)
+    {
+      sent_bytes += 4 + ORING_ALIGN(iovs[i].iov_len);
+      stat_add(&s->bytes_out, iovs[i].iov_len);
+    }
+    store_int(&s->oring_bytes, s->oring_bytes - sent_bytes);
+    if (r) s->oring_head = ends[r-1];
+    // The client has its own copies of the fds that went out
+    int done = 0;
+    while (done < num_fd && fd_index[done] < r) close_fds(s->pass[done++].fds);
+    if (done)
+    {
+      s->num_pass -= done;
+      memmove(s->pass, s->pass + done, s->num_pass * sizeof(*s->pass));
+    }
+  }
+
+  return true;
+}
+
+static void flush_out_queue (void)
+{
+  while (out_queue)
+  {
+    Session * s = out_queue;
+    bool ok = queue_motion(s, false); // Already on the queue, so no change there
+    out_queue = s->next_out;
+    s->next_out = NULL;
+    s->out_queued = false;
+    if (!ok || !send_queued(s)) io_close_session(s);
+  }
+}
+
+static Session * new_session (int fd)
+{
+  Session * s = calloc(1, sizeof(Session));
+  if (!s)
+  {
+    LOG_ERROR("Couldn't allocate session");
+    return NULL;
+  }
+  s->fd = fd;
+  static unsigned int next_id = 0;
+  s->id = ++next_id;
+
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+  ev.data.ptr = s;
+  if (epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, fd, &ev))
+  {
+    LOG_ERROR("Couldn't add session to epoll (errno:%i)", errno);
+    free(s);
+    return NULL;
+  }
+
+  to_render_control(s, CmdOpen);
+  LOG_DEBUG("new_session(%i)", fd);
+  return s;
+}
+
+// Closes the socket and tells the render thread.  The session itself
+// lives on until the render thread releases it.
+static void io_close_session (Session * s)
+{
+  if (s->io_closed) return;
+
+  LOG_DEBUG("io_close_session(%i)", s->fd);
+
+  // Give anything we queued (e.g., a QuitEvent) a chance to get out
+  send_queued(s);
+  if (s->out_queued)
+  {
+    Session ** pp = &out_queue;
+    while (*pp && *pp != s) pp = &(*pp)->next_out;
+    if (*pp) *pp = s->next_out;
+    s->out_queued = false;
+  }
+  if (s->read_stalled)
+  {
+    Session ** pp = &stalled_sessions;
+    while (*pp && *pp != s) pp = &(*pp)->next_stalled;
+    if (*pp) *pp = s->next_stalled;
+    s->read_stalled = false;
+  }
+  free(s->oring);
+  s->oring = NULL;
+  store_int(&s->oring_bytes, 0);
+  free(s->backlog);
+  s->backlog = NULL;
+  s->backlog_len = 0;
+  for (int i = 0; i < s->num_pass; i++) close_fds(s->pass[i].fds);
+  free(s->pass);
+  s->pass = NULL;
+  s->num_pass = s->max_pass = 0;
+
+  close(s->fd); // Also removes it from epoll
+  s->io_closed = true;
+
+  to_render_control(s, CmdHangup);
+}
+
+// Handles everything the render thread has sent us
+static void io_receive (void)
+{
+  uint32_t length;
+  Cmd * c;
+  while ((c = spsc_front(&to_io, &length)))
+  {
+    Session * s = c->s;
+    if (c->kind == CmdRelease)
+    {
+      free(s);
+    }
+    else if (s->io_closed)
+    {
+      // The render thread just hasn't heard yet
+      if (c->kind == CmdSendFd) close_fds(c->fds);
+    }
+    else
+    {
+      bool ok = true;
+      switch (c->kind)
+      {
+        case CmdSend: ok = io_send(s, c->data, c->length); break;
+        case CmdSendFd: ok = io_send_fd(s, c->data, c->length, c->fds); break;
+        case CmdMotion:
+          merge_motion(s, (MouseMoveEventMsg *)c->data);
+          queue_out(s);
+          break;
+        case CmdClose: ok = false; break;
+        default: break;
+      }
+      if (!ok) io_close_session(s);
+    }
+    spsc_pop(&to_io);
+  }
+}
+
+static void stall_session (Session * s)
+{
+  if (s->read_stalled) return;
+  s->read_stalled = true;
+  s->next_stalled = stalled_sessions;
+  stalled_sessions = s;
+  stat_add(&io_stats.read_stalls, 1);
+}
+
+// Queues a message from the client for the render thread
+static bool queue_in (Session * s, char * buf, int length)
+{
+  if (controls) return false; // They have to go first
+  if (!to_render_push(s, CmdMessage, buf, length)) return false;
+  stat_add(&s->msgs_in, 1);
+  stat_add(&s->bytes_in, length);
+  stat_add(&io_stats.msgs_in, 1);
+  return true;
+}
+
+// Keeps messages we've read but couldn't queue, each preceded by its size.
+// This only happens when the render thread is badly behind, so it doesn't
+// need to be clever.
+static bool keep_backlog (Session * s, const char * buf, int length)
+{
+  char * b = realloc(s->backlog, s->backlog_len + 4 + length);
+  if (!b)
+  {
+    LOG_ERROR("Couldn't allocate backlog");
+    return false;
+  }
+  s->backlog = b;
+  memcpy(b + s->backlog_len, &length, 4);
+  memcpy(b + s->backlog_len + 4, buf, length);
+  s->backlog_len += 4 + length;
+  return true;
+}
+
+// Queues as much of the backlog as will fit
+static bool drain_backlog (Session * s)
+{
+  int pos = 0;
+  while (pos < s->backlog_len)
+  {
+    int length;
+    memcpy(&length, s->backlog + pos, 4);
+    if (!queue_in(s, s->backlog + pos + 4, length)) break;
+    pos += 4 + length;
+  }
+  s->backlog_len -= pos;
+  memmove(s->backlog, s->backlog + pos, s->backlog_len);
+  if (s->backlog_len) return false;
+  free(s->backlog);
+  s->backlog = NULL;
+  return true;
+}
+
+static bool init_recv (void)
+{
+  if (recv_batch < 1) recv_batch = 1;
+  recv_msgs = calloc(recv_batch, sizeof(*recv_msgs));
+  recv_iovs = calloc(recv_batch, sizeof(*recv_iovs));
+  recv_arena = malloc((size_t)recv_batch * RECV_SLOT_SIZE);
+  if (!recv_msgs || !recv_iovs || !recv_arena) return false;
+
+  for (int i = 0; i < recv_batch; i++)
+  {
+    recv_iovs[i].iov_base = recv_arena + (size_t)i * RECV_SLOT_SIZE;
+    recv_iovs[i].iov_len = SDLUX_MAX_MESSAGE;
+    recv_msgs[i].msg_hdr.msg_iov = &recv_iovs[i];
+    recv_msgs[i].msg_hdr.msg_iovlen = 1;
+  }
+  return true;
+}
+
+// We're edge-triggered, so we have to keep reading until there's nothing
+// left, or until the render thread can't take any more.  In that case we
+// stop, and pick up again when it has made room (see retry_stalled()).
+static void read_session (Session * s)
+{
+  if (s->backlog && !drain_backlog(s))
+  {
+    stall_session(s);
+    return;
+  }
+
+  while (!s->io_closed)
+  {
+    for (int i = 0; i < recv_batch; i++) recv_msgs[i].msg_hdr.msg_flags = 0;
+
+    int count = recvmmsg(s->fd, recv_msgs, recv_batch, MSG_DONTWAIT, NULL);
+    if (count == -1)
+    {
+      if (errno == EINTR) continue;
+      if (errno == EAGAIN || errno == EWOULDBLOCK) break;
+      LOG_ERROR("recvmmsg() failed with errno:%i", errno);
+      io_close_session(s);
+      break;
+    }
+
+    for (int i = 0; i < count && !s->io_closed; i++)
+    {
+      char * buf = recv_iovs[i].iov_base;
+      int length = recv_msgs[i].msg_len;
+      if (length == 0)
+      {
+        // EOF, but whatever's in the backlog still has to get through
+        if (s->backlog) s->hup_pending = true;
+        else io_close_session(s);
+        break;
+      }
+      else if (recv_msgs[i].msg_hdr.msg_flags & MSG_TRUNC)
+      {
+        LOG_WARN("Message larger than %i bytes on fd:%i", SDLUX_MAX_MESSAGE, s->fd);
+        io_close_session(s);
+      }
+      else if (s->backlog || !queue_in(s, buf, length))
+      {
+        if (!keep_backlog(s, buf, length)) io_close_session(s);
+      }
+    }
+
+    if (s->backlog)
+    {
+      if (!s->io_closed) stall_session(s);
+      return;
+    }
+
+    // A short batch means the socket was empty, and we'll get a new edge
+    // when there's more.
+    if (count < recv_batch) break;
+  }
+
+  if (s->hup_pending) io_close_session(s);
+}
+
+// The render thread has made room, so pick up where we left off
+static void retry_stalled (void)
+{
+  Session * s = stalled_sessions;
+  stalled_sessions = NULL;
+  while (s)
+  {
+    Session * next = s->next_stalled;
+    s->next_stalled = NULL;
+    s->read_stalled = false;
+    read_session(s);
+    s = next;
+  }
+}
+
+static void accept_sessions (void)
+{
+  while (true)
+  {
+    int fd = accept4(listen_fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if (fd < 0)
+    {
+      if (errno == EINTR) continue;
+      if (errno != EAGAIN && errno != EWOULDBLOCK)
+      {
+        LOG_ERROR("accept() failed with errno %i", errno);
+      }
+      return;
+    }
+    LOG_DEBUG("New session arrived");
+    if (!new_session(fd)) close(fd);
+  }
+}
+
+static void * io_main (void * arg)
+{
+  static struct epoll_event events[SDLUX_EPOLL_BATCH];
+
+  while (true)
+  {
+    io_receive();
+    if (flush_controls() && stalled_sessions) retry_stalled();
+
+    // Send whatever we've queued up before sleeping
+    flush_out_queue();
+    if (to_render_pushed)
+    {
+      to_render_pushed = false;
+      wake(render_wake_fd);
+    }
+
+    int count = epoll_wait(io_epoll_fd, events, SDLUX_EPOLL_BATCH, -1);
+    stat_add(&io_stats.wakeups, 1);
+    if (count == -1)
+    {
+      if (errno == EINTR) continue;
+      LOG_ERROR("epoll_wait() failed in I/O thread with errno %i\n", errno);
+      exit(1);
+    }
+
+    for (int i = 0; i < count; i++)
+    {
+      Session * s = events[i].data.ptr;
+      uint32_t revents = events[i].events;
+      if (!s)
+      {
+        accept_sessions();
+        continue;
+      }
+      if (s == (void *)&wake_marker)
+      {
+        clear_wake(io_wake_fd);
+        continue;
+      }
+      if (s->io_closed) continue;
+
+      if (revents & EPOLLOUT)
+      {
+        // Gets sent when we flush, along with any deferred motion
+        s->out_blocked = false;
+        queue_out(s);
+      }
+      if ((revents & EPOLLIN) && !s->read_stalled) read_session(s);
+      if (revents & (EPOLLERR|EPOLLHUP|EPOLLRDHUP))
+      {
+        // Don't lose whatever the client sent before it hung up
+        if (s->read_stalled) s->hup_pending = true;
+        else io_close_session(s);
+      }
+    }
+  }
+
+  return NULL;
+}
+
+
+// ---- Render thread ----
+
+// Color cursors are drawn by us, on top of everything else on the screen.
+// We keep what was under the cursor, so moving it only means putting that
+// back and drawing it somewhere else, rather than redrawing the windows.
+static struct
+{
+  Session * s; // Whose window the pointer is over, or NULL
+  int x, y; // Where the pointer is on the screen
+  bool dirty; // Has moved or changed since it was drawn
+  bool drawn; // If so, under holds what it covers
+  SDL_Rect rect; // Where it's drawn
+  Uint32 under[SDLUX_MAX_COLOR_CURSOR * SDLUX_MAX_COLOR_CURSOR];
+} overlay;
+
+// The F2 window switcher, or NULL if it isn't open
+static Window * switcher = NULL;
+static int switcher_cols = 1;
+static Session * switch_to = NULL; // Picked in the switcher, to be raised
+static Session * switching_to = NULL; // Being clicked by switcher_raise()
+
+static void free_cursor (SessionCursor * c)
+{
+  if (c->sdl) SDL_FreeCursor(c->sdl);
+  free(c->color);
+  c->sdl = NULL;
+  c->color = NULL;
+}
+
+// Set when we've queued anything for the I/O thread since we last woke it
+static bool to_io_pushed = false;
+
+// Queues a Cmd for the I/O thread.  It always keeps up eventually, so if
+// there's no room we just wait.
+static void to_io_push (Session * s, CmdKind kind, const void * data, int length, const int * fds)
+{
+  Cmd * c = spsc_reserve(&to_io, sizeof(Cmd) + length);
+  if (!c)
+  {
+    stats.queue_waits++;
+    do
+    {
+      wake(io_wake_fd);
+      sched_yield();
+    } while (!(c = spsc_reserve(&to_io, sizeof(Cmd) + length)));
+  }
+  c->s = s;
+  c->kind = kind;
+  for (int i = 0; i < SDLUX_MAX_PASS_FDS; i++) c->fds[i] = fds ? fds[i] : -1;
+  c->length = length;
+  if (length) memcpy(c->data, data, length);
+  spsc_commit(&to_io);
+  to_io_pushed = true;
+}
+
+static void flush_to_io (void)
+{
+  if (!to_io_pushed) return;
+  to_io_pushed = false;
+  wake(io_wake_fd);
+}
+
+// Queues the message in obuf
+bool senddata (Session * s, int size)
+{
+  if (s->closed) return false;
+  to_io_push(s, CmdSend, &obuf, size + 4, NULL);
+  return true;
+}
+
+// Like senddata(), but the client also gets fds (-1 for unused ones) with
+// the message.  They're closed afterwards either way.
+static bool senddata_fds (Session * s, int size, int * fds)
+{
+  if (s->closed)
+  {
+    for (int i = 0; i < SDLUX_MAX_PASS_FDS; i++) if (fds[i] >= 0) close(fds[i]);
+    return false;
+  }
+  to_io_push(s, CmdSendFd, &obuf, size + 4, fds);
+  return true;
+}
+
+// Like senddata(), but the client also gets a copy of fb.fd with the message
+static bool senddata_fb_fd (Session * s, int size)
+{
+  if (s->closed) return false;
+  int fds[SDLUX_MAX_PASS_FDS] = {-1, -1};
+  fds[0] = fcntl(s->fb.fd, F_DUPFD_CLOEXEC, 0);
+  if (fds[0] < 0)
+  {
+    LOG_ERROR("Couldn't dup framebuffer fd (errno:%i)", errno);
+    return false;
+  }
+  return senddata_fds(s, size, fds);
+}
+
+static void free_event_ring (Session * s)
+{
+  if (s->ring_bell >= 0) close(s->ring_bell);
+  s->ring_bell = -1;
+  s->ring_overflowed = false;
+  shmbuf_free(&s->ring_mem);
+}
+
+// Puts the event message in obuf into the session's event ring.  Returns
+// false if it has to go over the socket instead.
+static bool ring_push (Session * s, int size)
+{
+  if (s->ring_bell < 0 || s->ring_overflowed) return false;
+  void * p = spsc_reserve(&s->ring, size + 4);
+  if (!p)
+  {
+    // Whatever comes next has to be read after what's in the ring, so it's
+    // the socket from now on
+    LOG_WARN("Event ring full on fd:%i", s->fd);
+    s->ring_overflowed = true;
+    stats.ring_overflows++;
+    return false;
+  }
+  memcpy(p, &obuf, size + 4);
+  stats.ring_events++;
+  if (spsc_commit_notify(&s->ring))
+  {
+    wake(s->ring_bell);
+    stats.ring_bells++;
+  }
+  return true;
+}
+
+// Whether the client wants events of this type (see SetEventMaskMsg).
+// Checked before building the message, so unwanted ones cost nothing.
+static bool wants_event (Session * s, MsgType type)
+{
+  if (s->event_mask & type) return true;
+  stats.events_masked++;
+  return false;
+}
+
+// Like senddata(), but for input events, which use the event ring if the
+// client has one
+static bool sendevent (Session * s, int size)
+{
+  if (s->closed) return false;
+  return ring_push(s, size) || senddata(s, size);
+}
+
+// How often we take frames from the session right now (us)
+static int session_interval_us (Session * s)
+{
+  if (s->hidden) return 1000000 / SDLUX_HIDDEN_FPS;
+  return sched_interval_us(&sched);
+}
+
+// Fills in fm for the frame of the session's which was just shown
+static void fill_flipped (Session * s, FlippedMsg * fm, uint64_t present_time)
+{
+  fm->frame = s->frames_shown;
+  fm->interval = session_interval_us(s);
+  fm->dropped = s->frames_dropped;
+  fm->present_time = present_time;
+}
+
+// Updates the FlippedMsg fields in the session's PresentSyncShared
+static void sync_shown (Session * s, uint64_t present_time)
+{
+  PresentSyncShared * ps = (void *)s->sync_mem.mem;
+  FlippedMsg fm;
+  fill_flipped(s, &fm, present_time);
+  __atomic_store_n(&ps->frame, fm.frame, __ATOMIC_RELAXED);
+  __atomic_store_n(&ps->interval, fm.interval, __ATOMIC_RELAXED);
+  __atomic_store_n(&ps->dropped, fm.dropped, __ATOMIC_RELAXED);
+  __atomic_store_n(&ps->present_time, present_time, __ATOMIC_RELAXED);
+}
+
+// Tells the client its frame has been shown (at present_time), or in
+// mailbox mode, which buffer to draw into next.  That's done with Flipped
+// or NextBuffer, or through its PresentSyncShared if it has one.
+static bool send_presented (Session * s, uint64_t present_time)
+{
+  if (s->closed) return false;
+  if (recording && !record_presented(s->id)) record_failed();
+  if (!s->sync_mem.mem)
+  {
+    if (s->mailbox)
+    {
+      OMSG(NextBuffer, nb);
+      nb->index = s->back;
+      return senddata(s, sizeof(*nb));
+    }
+    OMSG(Flipped, fm);
+    fill_flipped(s, fm, present_time);
+    return senddata(s, sizeof(*fm));
+  }
+
+  PresentSyncShared * ps = (void *)s->sync_mem.mem;
+  int back = 0;
+  if (s->mailbox) back = s->back;
+  else if (s->num_buffers == 2) back = s->front ^ (s->swap_pending ? 0 : 1);
+  if (!s->mailbox) sync_shown(s, present_time);
+  __atomic_store_n(&ps->back, back, __ATOMIC_RELAXED);
+  __atomic_store_n(&ps->seq, ++s->sync_seq, __ATOMIC_RELEASE);
+  stats.sync_presents++;
+
+  // Pairs with the client setting waiting and then checking seq, so one
+  // of us sees the other
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  if (__atomic_load_n(&ps->waiting, __ATOMIC_RELAXED))
+  {
+    syscall(SYS_futex, &ps->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+    stats.sync_wakes++;
+  }
+  return true;
+}
+
+// The I/O thread has a new session for us
+static void add_session (Session * s)
+{
+  s->pending = -1;
+  shmbuf_init(&s->fb);
+  shmbuf_init(&s->ring_mem);
+  shmbuf_init(&s->sync_mem);
+  s->ring_bell = -1;
+  s->event_mask = SDLUX_EVENT_TYPES;
+
+  if (num_sessions == max_sessions)
+  {
+    int n = max_sessions ? max_sessions * 2 : 16;
+    Session ** ns = realloc(sessions, n * sizeof(Session*));
+    if (!ns)
+    {
+      LOG_ERROR("Couldn't grow session table");
+      s->closed = true;
+      to_io_push(s, CmdClose, NULL, 0, NULL);
+      return;
+    }
+    sessions = ns;
+    max_sessions = n;
+  }
+
+  s->index = num_sessions;
+  sessions[num_sessions++] = s;
+  LOG_DEBUG("add_session(%i) -> %i sessions", s->fd, num_sessions);
+  if (recording && !record_open(s->id)) record_failed();
+}
+
+void close_session (Session * s)
+{
+  if (!s || s->closed) return;
+
+  LOG_DEBUG("close_session(%i)", s->fd);
+
+  s->closed = true;
+  if (!s->hung_up) to_io_push(s, CmdClose, NULL, 0, NULL);
+  if (s->hidden) num_hidden--;
+
+  if (s->do_draw)
+  {
+    Session ** pp = &draw_queue;
+    while (*pp && *pp != s) pp = &(*pp)->next_draw;
+    if (*pp) *pp = s->next_draw;
+    s->do_draw = false;
+  }
+
+  // Swap the last session into our spot
+  Session * last = sessions[--num_sessions];
+  last->index = s->index;
+  sessions[s->index] = last;
+  sessions[num_sessions] = NULL;
+
+  for (int i = 0; i < s->num_buffers; i++) SDL_FreeSurface(s->surfs[i]);
+  s->num_buffers = 0;
+  shmbuf_free(&s->fb);
+  free_event_ring(s);
+  shmbuf_free(&s->sync_mem);
+  if (s->thumb) SDL_FreeSurface(s->thumb);
+  s->thumb = NULL;
+  if (switcher) window_dirty(switcher);
+  if (switch_to == s) switch_to = NULL;
+  if (!record_close(s->id, &s->rec_shadow)) record_failed();
+
+  if (overlay.s == s)
+  {
+    overlay.s = NULL;
+    overlay.dirty = true;
+  }
+  s->color_cursor = NULL;
+  if (s->cursors)
+  {
+    for (int i = 0; i < s->num_cursors; i++) free_cursor(&s->cursors[i]);
+    free(s->cursors);
+    s->cursors = NULL;
+  }
+
+  if (s->wnd)
   {
-    if (sscanf(d, "%ix%i", &w, &h) != 2)
-    {
-      return false;
-    }
+    s->wnd->opaque_ptr = NULL;
+    window_close(s->wnd);
+    s->wnd = NULL;
   }
+}
 
-  if (w < 20) w = 20;
-  if (h < 10) h = 10;
+// The I/O thread is done with the session, so once we are, it can go
+static void hangup_session (Session * s)
+{
+  s->hung_up = true;
+  close_session(s);
+  to_io_push(s, CmdRelease, NULL, 0, NULL);
+}
 
-  *ww = w; *hh = h;
+static SDL_Surface * front_surface (Session * s)
+{
+  if (!s->num_buffers) return NULL;
+  return s->surfs[s->front];
+}
 
+static bool rect_touches (const SDL_Rect * a, const SDL_Rect * b)
+{
+  if (a->x > b->x + b->w) return false;
+  if (b->x > a->x + a->w) return false;
+  if (a->y > b->y + b->h) return false;
+  if (b->y > a->y + a->h) return false;
   return true;
 }
 
+static void rect_union (SDL_Rect * a, const SDL_Rect * b)
+{
+  int x1 = a->x < b->x ? a->x : b->x;
+  int y1 = a->y < b->y ? a->y : b->y;
+  int x2 = (a->x + a->w > b->x + b->w) ? a->x + a->w : b->x + b->w;
+  int y2 = (a->y + a->h > b->y + b->h) ? a->y + a->h : b->y + b->h;
+  a->x = x1;
+  a->y = y1;
+  a->w = x2 - x1;
+  a->h = y2 - y1;
+}
 
-static void about_key_handler (Window * w, SDL_keysym * k, bool down)
+// The switcher's thumbnail only needs the bounding box of what changed
+static void thumb_damage_add (Session * s, int x, int y, int w, int h)
 {
-  if (k->unicode == 'q' || k->unicode == 'Q') quitting = true;
+  SDL_Rect r = {x, y, w, h};
+  if (s->thumb_dirty) rect_union(&s->thumb_damage, &r);
+  else s->thumb_damage = r;
+  s->thumb_dirty = true;
 }
 
-void about_click_handler (Window * w, int x, int y, int buttons, int type, bool raised)
+static void damage_add (Session * s, int x, int y, int w, int h)
 {
-  window_close(w);
+  SDL_Surface * surf = front_surface(s);
+  if (!surf) return;
+
+  // Clip to the surface
+  if (x < 0) { w += x; x = 0; }
+  if (y < 0) { h += y; y = 0; }
+  if (x + w > surf->w) w = surf->w - x;
+  if (y + h > surf->h) h = surf->h - y;
+  if (w <= 0 || h <= 0) return;
+
+  thumb_damage_add(s, x, y, w, h);
+  if (s->damage_full) return;
+
+  SDL_Rect r = {x, y, w, h};
+
+  // Merge with anything it touches.  Merging can make the result touch
+  // something it didn't before, so keep going until nothing changes.
+  bool merged = true;
+  while (merged)
+  {
+    merged = false;
+    for (int i = 0; i < s->num_damage; i++)
+    {
+      if (!rect_touches(&r, &s->damage[i])) continue;
+      rect_union(&r, &s->damage[i]);
+      s->damage[i] = s->damage[--s->num_damage];
+      merged = true;
+      break;
+    }
+  }
+
+  if (s->num_damage == SDLUX_MAX_DAMAGE)
+  {
+    for (int i = 1; i < s->num_damage; i++) rect_union(&s->damage[0], &s->damage[i]);
+    s->num_damage = 1;
+    rect_union(&s->damage[0], &r);
+    return;
+  }
+
+  s->damage[s->num_damage++] = r;
 }
 
-bool about_draw_handler (Window * w, SDL_Surface * scr, SDL_Rect r)
+static void queue_draw (Session * s)
 {
-  window_clear_client(w, w->bg_color);
-  text_draw(scr, "SDLuxer by Murphy McCauley\n\nPress 'Q' to quit.", r.x, r.y, 0xffFFffFF);
-  return true;
+  if (s->do_draw) return;
+  s->do_draw = true;
+  s->next_draw = draw_queue;
+  draw_queue = s;
 }
 
-static void f1_handler (FKey * fkey)
+static void damage_all (Session * s)
 {
-  Window * w = window_create(200, lux_sysfont_h()*3, "SDLuxer", 0);
-  w->on_mousedown = about_click_handler;
-  w->bg_color = lux_get_theme().win.face;
-  w->on_draw = about_draw_handler;
-  w->on_keydown = about_key_handler;
+  s->damage_full = true;
+  s->num_damage = 0;
+  s->thumb_dirty = true;
+  s->thumb_full = true;
 }
 
-typedef struct SavedBuffer_tag
+// Sets *out to the overlap of a and b, returning false if there isn't any
+static bool rect_intersect (const SDL_Rect * a, const SDL_Rect * b, SDL_Rect * out)
 {
-  struct SavedBuffer_tag * next;
-  int size;
-  char data[0];
-} SavedBuffer;
+  int x1 = a->x > b->x ? a->x : b->x;
+  int y1 = a->y > b->y ? a->y : b->y;
+  int x2 = (a->x + a->w < b->x + b->w) ? a->x + a->w : b->x + b->w;
+  int y2 = (a->y + a->h < b->y + b->h) ? a->y + a->h : b->y + b->h;
+  if (x2 <= x1 || y2 <= y1) return false;
+  out->x = x1;
+  out->y = y1;
+  out->w = x2 - x1;
+  out->h = y2 - y1;
+  return true;
+}
 
-typedef struct
+// Puts what's left of r once o is taken out of it into out (as up to four
+// rectangles: full-width bands above and below o, and the bits either side)
+static int rect_subtract (const SDL_Rect * r, const SDL_Rect * o, SDL_Rect * out)
 {
-  Window * wnd;
-  SDL_Surface * surf1;
-  SDL_Surface * surf2;
-  void * shmem;
-  size_t shmem_size;
-  char * shmem_name;
-  SavedBuffer * buffered_out;
-  int fd;
-  bool flip_wait;
-  bool do_draw;
-  int num_cursors;
-  SDL_Cursor ** cursors;
-} Session;
+  SDL_Rect i;
+  if (!rect_intersect(r, o, &i))
+  {
+    out[0] = *r;
+    return 1;
+  }
+  int n = 0;
+  if (i.y > r->y) out[n++] = (SDL_Rect){r->x, r->y, r->w, i.y - r->y};
+  if (i.y + i.h < r->y + r->h) out[n++] = (SDL_Rect){r->x, i.y + i.h, r->w, r->y + r->h - i.y - i.h};
+  if (i.x > r->x) out[n++] = (SDL_Rect){r->x, i.y, i.x - r->x, i.h};
+  if (i.x + i.w < r->x + r->w) out[n++] = (SDL_Rect){i.x + i.w, i.y, r->x + r->w - i.x - i.w, i.h};
+  return n;
+}
 
-// Since we use poll(), we keep a 1:1 mapping between file descriptors and
-// sessions.  So this really is like "max file descriptors".  We could keep
-// a map or something, but the real solution is to use epoll or some other
-// well-designed API.
-#define SDLUX_MAX_SESSIONS 128
-struct pollfd session_fds[SDLUX_MAX_SESSIONS] = {};
-Session sessions[SDLUX_MAX_SESSIONS] = {};
-int max_fd;
-int listen_fd;
+// Where the window's client area is on the screen
+static void client_screen_rect (Window * w, SDL_Rect * r)
+{
+  window_get_client_rect(w, r);
+  window_rect_window_to_screen(w, r);
+}
 
+static int compare_raised (const void * a, const void * b)
+{
+  const Session * sa = *(Session * const *)a;
+  const Session * sb = *(Session * const *)b;
+  if (sa->raised == sb->raised) return 0;
+  return sa->raised > sb->raised ? -1 : 1; // Top first
+}
 
-char * listen_sock_name = NULL;
+// Tells the client whether it can be seen, the way SDL tells applications
+// they've been iconified
+static void send_visibility (Session * s)
+{
+  if (!wants_event(s, ActiveEvent)) return;
+  OMSG(ActiveEvent, m);
+  m->event.type = SDL_ACTIVEEVENT;
+  m->event.gain = s->hidden ? 0 : 1;
+  m->event.state = SDL_APPACTIVE;
+  if (!sendevent(s, sizeof(*m))) close_session(s);
+}
 
-bool senddata (int fd, int size)
+// Works out how much of each client window can be seen, from the top down.
+// We only know about our own windows (and only their client areas), so
+// anything else on the screen just means we draw a bit more than we need.
+static void update_visibility (void)
 {
-  char * buf = (char*)&obuf;
-  size += 4;
-  Session * s = sessions+fd;
-  while (true)
+  static Session ** order = NULL;
+  static SDL_Rect * rects = NULL; // Screen rects, in the same order
+  static int max_order = 0;
+  if (num_sessions > max_order)
   {
-    bool save = false;
-    if (s->buffered_out)
+    Session ** no = realloc(order, num_sessions * sizeof(*order));
+    if (no) order = no;
+    SDL_Rect * nr = realloc(rects, num_sessions * sizeof(*rects));
+    if (nr) rects = nr;
+    if (!no || !nr)
     {
-      save = true;
+      LOG_ERROR("Couldn't allocate visibility tables");
+      return;
     }
-    else
+    max_order = num_sessions;
+  }
+
+  // Lux tells us when windows are raised, but it's the authority on which
+  // one is on top, so make sure we agree.
+  int n = 0;
+  for (int i = 0; i < num_sessions; i++)
+  {
+    Session * s = sessions[i];
+    if (!s->wnd) continue;
+    if (s->raised != raise_count && window_is_top(s->wnd)) s->raised = ++raise_count;
+    order[n++] = s;
+  }
+  qsort(order, n, sizeof(*order), compare_raised);
+
+  SDL_Rect screen = {0, 0, screen_width, screen_height};
+  for (int i = 0; i < n; i++)
+  {
+    Session * s = order[i];
+    client_screen_rect(s->wnd, &rects[i]);
+    SDL_Rect r = rects[i];
+
+    SDL_Rect vis[SDLUX_MAX_EXPOSED];
+    int num = rect_intersect(&r, &screen, &vis[0]) ? 1 : 0;
+    bool all = num && vis[0].x == r.x && vis[0].y == r.y && vis[0].w == r.w && vis[0].h == r.h;
+    bool overflow = false;
+    for (int j = 0; j < i && num && !overflow; j++)
     {
-      int r = send(fd, buf, size, 0);
-      if (r == size)
+      SDL_Rect dummy;
+      if (!rect_intersect(&r, &rects[j], &dummy)) continue;
+      all = false;
+      SDL_Rect next[SDLUX_MAX_EXPOSED];
+      int num_next = 0;
+      for (int k = 0; k < num; k++)
       {
-        LOG_DEBUG("Send okay");
-        return true;
+        SDL_Rect pieces[4];
+        int p = rect_subtract(&vis[k], &rects[j], pieces);
+        if (num_next + p > SDLUX_MAX_EXPOSED)
+        {
+          overflow = true;
+          break;
+        }
+        for (int q = 0; q < p; q++) next[num_next++] = pieces[q];
       }
-      if (r == -1 && errno == EINTR) continue;
+      if (overflow) break;
+      memcpy(vis, next, num_next * sizeof(SDL_Rect));
+      num = num_next;
+    }
 
-      if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
+    bool was_hidden = s->hidden;
+    s->exposed_all = all || overflow;
+    s->hidden = !s->exposed_all && num == 0;
+    s->num_exposed = 0;
+    if (!s->exposed_all)
+    {
+      for (int k = 0; k < num; k++)
       {
-        save = true;
+        s->exposed[k] = vis[k];
+        s->exposed[k].x -= r.x;
+        s->exposed[k].y -= r.y;
       }
+      s->num_exposed = num;
+    }
+
+    if (s->hidden == was_hidden) continue;
+    num_hidden += s->hidden ? 1 : -1;
+    if (!s->hidden)
+    {
+      // We haven't been keeping what's on the screen up to date
+      s->hidden_next_frame = 0;
+      damage_all(s);
+      window_dirty(s->wnd);
     }
+    send_visibility(s);
+  }
+}
+
+static ColorCursor * overlay_cursor (void)
+{
+  Session * s = overlay.s;
+  if (!s || s->cursor_hidden) return NULL;
+  return s->color_cursor;
+}
+
+// Puts back what the cursor covered (the screen must be locked)
+static bool overlay_erase (SDL_Surface * scr)
+{
+  if (!overlay.drawn) return false;
+  overlay.drawn = false;
+  SDL_Rect * r = &overlay.rect;
+  for (int y = 0; y < r->h; y++)
+  {
+    Uint32 * row = (Uint32 *)((char *)scr->pixels + (r->y + y) * scr->pitch) + r->x;
+    memcpy(row, overlay.under + y * r->w, r->w * 4);
+  }
+  return true;
+}
 
-    if (save)
+// Draws the cursor, keeping what it covers (the screen must be locked)
+static void overlay_draw (SDL_Surface * scr)
+{
+  ColorCursor * c = overlay_cursor();
+  if (!c) return;
+  SDL_Rect r = {overlay.x - c->hotx, overlay.y - c->hoty, c->w, c->h};
+  SDL_Rect all = {0, 0, scr->w, scr->h};
+  if (!rect_intersect(&r, &all, &overlay.rect)) return;
+  r = overlay.rect;
+  int cx = r.x - (overlay.x - c->hotx);
+  int cy = r.y - (overlay.y - c->hoty);
+
+  SDL_PixelFormat * f = scr->format;
+  for (int y = 0; y < r.h; y++)
+  {
+    Uint32 * row = (Uint32 *)((char *)scr->pixels + (r.y + y) * scr->pitch) + r.x;
+    const Uint32 * src = c->pixels + (cy + y) * c->w + cx;
+    memcpy(overlay.under + y * r.w, row, r.w * 4);
+    for (int x = 0; x < r.w; x++)
     {
-      SavedBuffer * saved = malloc(sizeof(SavedBuffer) + size);
-      if (saved)
+      Uint32 p = src[x];
+      int a = p >> 24;
+      if (a == 0) continue;
+      Uint8 sr = p >> 16, sg = p >> 8, sb = p;
+      if (a != 255)
       {
-        saved->size = size;
-        saved->next = NULL;
-        memcpy(saved->data, buf, size);
-        if (!s->buffered_out)
-        {
-          s->buffered_out = saved;
-        }
-        else
-        {
-          SavedBuffer * old = s->buffered_out;
-          while (old->next) old = old->next;
-          old->next = saved;
-        }
-        session_fds[fd].events |= POLLOUT;
-        LOG_DEBUG("Send buffered");
-        return true;
+        Uint8 dr, dg, db;
+        SDL_GetRGB(row[x], f, &dr, &dg, &db);
+        sr = (sr * a + dr * (255 - a)) / 255;
+        sg = (sg * a + dg * (255 - a)) / 255;
+        sb = (sb * a + db * (255 - a)) / 255;
       }
-      LOG_ERROR("Couldn't buffer outgoing message");
-      return false;
+      row[x] = SDL_MapRGB(f, sr, sg, sb);
     }
-
-    LOG_ERROR("Incomplete send!");
-    return false;
   }
-  LOG_ERROR("Unreachable code reached?!");
-  return false; // Unreachable
+  overlay.drawn = true;
 }
 
+// The screen must be 32 bit for us to draw color cursors on it
+static SDL_Surface * overlay_screen (void)
+{
+  SDL_Surface * scr = SDL_GetVideoSurface();
+  if (!scr || scr->format->BytesPerPixel != 4) return NULL;
+  return scr;
+}
 
-bool new_session (int fd)
+// Takes the cursor off the screen before anything else is drawn, so what
+// we keep under it stays right.  Returns true if it was there.
+static bool overlay_hide (void)
 {
-  if (fd == listen_fd) return false;
-  if (fd >= SDLUX_MAX_SESSIONS) return false;
-  if (session_fds[fd].fd >= 0) return false;
+  SDL_Surface * scr = overlay_screen();
+  if (!scr || !overlay.drawn) return false;
+  if (SDL_MUSTLOCK(scr) && SDL_LockSurface(scr) != 0) return false;
+  overlay_erase(scr);
+  if (SDL_MUSTLOCK(scr)) SDL_UnlockSurface(scr);
+  return true;
+}
 
-  session_fds[fd].fd = fd;
-  session_fds[fd].events = POLLIN;
+// Redraws the cursor if it has moved or changed, updating just the bits of
+// the screen it was and is on
+static void overlay_update (void)
+{
+  if (!overlay.dirty) return;
+  overlay.dirty = false;
+  SDL_Surface * scr = overlay_screen();
+  if (!scr) return;
+  if (SDL_MUSTLOCK(scr) && SDL_LockSurface(scr) != 0) return;
+
+  SDL_Rect rects[2];
+  int n = 0;
+  if (overlay.drawn) rects[n++] = overlay.rect;
+  overlay_erase(scr);
+  overlay_draw(scr);
+  if (overlay.drawn) rects[n++] = overlay.rect;
+
+  if (SDL_MUSTLOCK(scr)) SDL_UnlockSurface(scr);
+  if (n) SDL_UpdateRects(scr, n, rects);
+  stats.cursor_draws++;
+}
 
-  sessions[fd].fd = fd;
+// The pointer is at x,y in s's window (or has left it, if s is NULL)
+static void overlay_move (Session * s, int x, int y)
+{
+  bool had = overlay_cursor() != NULL;
+  overlay.s = s;
+  if (s)
+  {
+    SDL_Rect r;
+    client_screen_rect(s->wnd, &r);
+    overlay.x = r.x + x;
+    overlay.y = r.y + y;
+  }
+  if (had || overlay_cursor()) overlay.dirty = true;
+}
 
-  if (fd > max_fd) max_fd = fd;
+// Picks which of the session's cursors we draw ourselves (NULL for none)
+static void set_color_cursor (Session * s, ColorCursor * c)
+{
+  s->color_cursor = c;
+  // Lux shows the system cursor, which mustn't show on top of ours
+  if (s->wnd) window_cursor_show(s->wnd, !s->cursor_hidden && !c);
+  if (overlay.s == s) overlay.dirty = true;
 }
 
-void close_session (int fd)
+// Adds a cursor to the session's table, returning its index (or -1)
+static int add_cursor (Session * s, SDL_Cursor * sdl, ColorCursor * color)
 {
-  // Reset max_fd
-  if (fd < 0) return;
-  if (fd > SDLUX_MAX_SESSIONS) return;
-  close(fd);
-  //TODO: dup the max fd down into the closed fd!
+  // We could look for a "free" spot, but we don't.
+  SessionCursor * nc = realloc(s->cursors, sizeof(SessionCursor) * (s->num_cursors+1));
+  if (!nc)
+  {
+    LOG_ERROR("Couldn't allocate cursor memory");
+    if (sdl) SDL_FreeCursor(sdl);
+    free(color);
+    return -1;
+  }
+  s->cursors = nc;
+  nc[s->num_cursors].sdl = sdl;
+  nc[s->num_cursors].color = color;
+  return s->num_cursors++;
+}
 
-  LOG_DEBUG("close_session(%i)", fd);
-  if (fd == max_fd)
+// Brings the session's thumbnail up to date with its front buffer.  Only
+// the boxes touched by damage since last time are shrunk again, so a
+// client which redraws a little of its window costs us very little.
+static SDL_Surface * update_thumb (Session * s)
+{
+  SDL_Surface * surf = front_surface(s);
+  if (!surf) return NULL;
+
+  // Shrink by whatever whole factor fits it in a switcher cell
+  int k = (surf->w + SDLUX_THUMB_W - 1) / SDLUX_THUMB_W;
+  int ky = (surf->h + SDLUX_THUMB_H - 1) / SDLUX_THUMB_H;
+  if (ky > k) k = ky;
+  if (k < 1) k = 1;
+  if (k > 64) k = 64; // The most blit_shrink() can do
+  int tw = surf->w / k, th = surf->h / k;
+  if (tw < 1 || th < 1) return NULL;
+
+  bool fresh = false;
+  if (!s->thumb || s->thumb->w != tw || s->thumb->h != th || s->thumb_factor != k)
   {
-    max_fd = -1;
-    for (int i = fd-1; i >= 0; i--)
+    fresh = true;
+    if (s->thumb) SDL_FreeSurface(s->thumb);
+    s->thumb = SDL_CreateRGBSurface(SDL_SWSURFACE, tw, th, 32, rmask, gmask, bmask, 0);
+    if (!s->thumb) return NULL;
+    s->thumb_factor = k;
+    s->thumb_full = true;
+    s->thumb_dirty = true;
+  }
+  if (!s->thumb_dirty) return s->thumb;
+
+  // The damage is for the client's latest frame, which won't be in the
+  // front buffer until it's swapped in (later, if it's held while the
+  // window is covered), so keep it until then
+  bool keep = s->do_draw;
+  if (keep && !fresh) return s->thumb;
+
+  // Round the damage out to whole boxes
+  SDL_Rect r = s->thumb_damage;
+  if (s->thumb_full) r = (SDL_Rect){0, 0, surf->w, surf->h};
+  if (!keep)
+  {
+    s->thumb_dirty = false;
+    s->thumb_full = false;
+  }
+  int x0 = r.x / k, y0 = r.y / k;
+  int x1 = (r.x + r.w + k - 1) / k, y1 = (r.y + r.h + k - 1) / k;
+  if (x1 > tw) x1 = tw;
+  if (y1 > th) y1 = th;
+  if (x0 >= x1 || y0 >= y1) return s->thumb;
+
+  SDL_Surface * t = s->thumb;
+  Uint8 * dst = (Uint8 *)t->pixels + y0 * t->pitch + x0 * 4;
+  int w = (x1 - x0) * k;
+  SDL_PixelFormat * f = surf->format;
+  if (f->BytesPerPixel == 4 && f->Rmask == rmask && f->Gmask == gmask && f->Bmask == bmask)
+  {
+    const Uint8 * src = (const Uint8 *)surf->pixels + y0 * k * surf->pitch + x0 * k * 4;
+    blit_shrink((Uint32 *)dst, t->pitch, (const Uint32 *)src, surf->pitch, w, (y1 - y0) * k, k);
+  }
+  else
+  {
+    // Convert a row of boxes at a time to our format, then shrink that
+    static SDL_Surface * band = NULL;
+    if (!band || band->w < w || band->h < k)
     {
-      if (session_fds[i].fd >= 0)
-      {
-        max_fd = i;
-        break;
-      }
+      if (band) SDL_FreeSurface(band);
+      band = SDL_CreateRGBSurface(SDL_SWSURFACE, surf->w, 64, 32, rmask, gmask, bmask, 0);
+      if (!band) return s->thumb;
+    }
+    for (int y = y0; y < y1; y++)
+    {
+      SDL_Rect sr = {x0 * k, y * k, w, k};
+      SDL_Rect dr = {0, 0, w, k};
+      blit_rect(surf, &sr, band, &dr);
+      blit_shrink((Uint32 *)dst, t->pitch, band->pixels, band->pitch, w, k, k);
+      dst += t->pitch;
     }
   }
 
-  session_fds[fd].fd = -1;
-  session_fds[fd].events = 0;
-  session_fds[fd].revents = 0;
+  stats.thumb_updates++;
+  stats.thumb_pixels += (uint64_t)w * (y1 - y0) * k;
+  return s->thumb;
+}
+
+static bool switcher_shows (Session * s)
+{
+  return s->wnd && s->num_buffers;
+}
 
-  if (fd == listen_fd) return;
+// The session in the given switcher cell, or NULL
+static Session * switcher_session (int cell)
+{
+  for (int i = 0; i < num_sessions; i++)
+  {
+    if (!switcher_shows(sessions[i])) continue;
+    if (cell-- == 0) return sessions[i];
+  }
+  return NULL;
+}
 
-  Session * s = sessions+fd;
+static void switcher_close (void)
+{
+  if (!switcher) return;
+  own_window_closed(switcher);
+  window_close(switcher);
+  switcher = NULL;
+}
 
-  if (s->shmem_name)
+static bool switcher_draw_handler (Window * w, SDL_Surface * scr, SDL_Rect rect)
+{
+  window_clear_client(w, w->bg_color);
+  int cell = 0;
+  for (int i = 0; i < num_sessions; i++)
   {
-    shm_unlink(s->shmem_name);
-    free(s->shmem_name);
-    s->shmem_name = NULL;
+    Session * s = sessions[i];
+    if (!switcher_shows(s)) continue;
+    int col = cell % switcher_cols, row = cell / switcher_cols;
+    cell++;
+    int cx = SDLUX_THUMB_GAP + col * (SDLUX_THUMB_W + SDLUX_THUMB_GAP);
+    int cy = SDLUX_THUMB_GAP + row * (SDLUX_THUMB_H + SDLUX_THUMB_GAP);
+    if (cy + SDLUX_THUMB_H > rect.h) break; // No room for the rest
+    SDL_Surface * t = update_thumb(s);
+    if (!t) continue;
+
+    SDL_Rect sr = {0, 0, t->w, t->h};
+    if (sr.w > SDLUX_THUMB_W) sr.w = SDLUX_THUMB_W;
+    if (sr.h > SDLUX_THUMB_H) sr.h = SDLUX_THUMB_H;
+    SDL_Rect dr = {rect.x + cx + (SDLUX_THUMB_W - sr.w) / 2,
+                   rect.y + cy + (SDLUX_THUMB_H - sr.h) / 2, sr.w, sr.h};
+    blit_rect(t, &sr, scr, &dr);
   }
+  return true;
+}
 
-  if (s->surf1) SDL_FreeSurface(s->surf1);
-  if (s->surf2) SDL_FreeSurface(s->surf2);
-  if (s->shmem) munmap(s->shmem, s->shmem_size);
-  s->surf1 = s->surf2 = s->shmem = NULL;
+static void switcher_click_handler (Window * w, int x, int y, int button, int type, bool raised)
+{
+  int col = (x - SDLUX_THUMB_GAP) / (SDLUX_THUMB_W + SDLUX_THUMB_GAP);
+  int row = (y - SDLUX_THUMB_GAP) / (SDLUX_THUMB_H + SDLUX_THUMB_GAP);
+  Session * s = NULL;
+  if (x >= SDLUX_THUMB_GAP && y >= SDLUX_THUMB_GAP && col < switcher_cols)
+  {
+    s = switcher_session(row * switcher_cols + col);
+  }
+  switcher_close();
+  // We're inside Lux's event handling here, so click it afterwards
+  switch_to = s;
+}
 
-  if (s->cursors)
+// Where a window is on the screen, frame and all.  Lux only tells us where
+// the client area is within it, so assume the frame is as thick at the
+// right and bottom as it is at the left.
+static void window_screen_rect (Window * w, SDL_Rect * r)
+{
+  SDL_Rect c;
+  window_get_client_rect(w, &c);
+  *r = (SDL_Rect){0, 0, c.x * 2 + c.w, c.y + c.h + c.x};
+  window_rect_window_to_screen(w, r);
+}
+
+// Raises the window picked in the switcher.  Lux gives us no way to raise
+// a window, but raises one that's clicked, so click it in the biggest
+// piece of it that neither other clients' windows nor our own cover; its
+// client doesn't see the click.  If there's no such piece, there's
+// nowhere to click.
+static void switcher_raise (void)
+{
+  Session * s = switch_to;
+  switch_to = NULL;
+  if (!s || !s->wnd || s->hidden || window_is_top(s->wnd)) return;
+
+  SDL_Rect r;
+  client_screen_rect(s->wnd, &r);
+  SDL_Rect vis[SDLUX_MAX_EXPOSED];
+  int num = 0;
+  if (s->exposed_all)
+  {
+    SDL_Rect screen = {0, 0, screen_width, screen_height};
+    if (rect_intersect(&r, &screen, &vis[0])) num = 1;
+  }
+  else
   {
-    for (int i = 0; i < s->num_cursors; i++)
+    for (int k = 0; k < s->num_exposed; k++)
     {
-      if (!s->cursors[i]) continue;
-      SDL_FreeCursor(s->cursors[i]);
+      vis[num] = s->exposed[k];
+      vis[num].x += r.x;
+      vis[num++].y += r.y;
     }
-    free(s->cursors);
   }
 
-  if (s->wnd)
+  // Our own windows might be under it, but we don't know, so avoid them
+  // anyway.  If that makes too many pieces, we just have fewer to pick.
+  for (int i = 0; i < num_own_windows && num; i++)
   {
-    window_close(s->wnd);
-    s->wnd = NULL;
+    SDL_Rect o;
+    window_screen_rect(own_windows[i], &o);
+    SDL_Rect next[SDLUX_MAX_EXPOSED];
+    int num_next = 0;
+    for (int k = 0; k < num; k++)
+    {
+      SDL_Rect pieces[4];
+      int p = rect_subtract(&vis[k], &o, pieces);
+      for (int q = 0; q < p && num_next < SDLUX_MAX_EXPOSED; q++) next[num_next++] = pieces[q];
+    }
+    memcpy(vis, next, num_next * sizeof(SDL_Rect));
+    num = num_next;
   }
 
-  if (s->buffered_out)
+  int best = -1;
+  for (int k = 0; k < num; k++)
   {
-    SavedBuffer * sb = s->buffered_out;
-    s->buffered_out = NULL;
-    while (sb)
-    {
-      SavedBuffer * nxt = sb->next;
-      free(sb);
-      sb = nxt;
-    }
+    if (best < 0 || vis[k].w * vis[k].h > vis[best].w * vis[best].h) best = k;
   }
+  if (best < 0)
+  {
+    LOG_DEBUG("Nowhere to click to raise fd:%i", s->fd);
+    return;
+  }
+  r = vis[best];
+
+  SDL_Event e = {};
+  e.type = SDL_MOUSEBUTTONDOWN;
+  e.button.button = SDL_BUTTON_LEFT;
+  e.button.state = SDL_PRESSED;
+  e.button.x = r.x + r.w / 2;
+  e.button.y = r.y + r.h / 2;
+  switching_to = s;
+  lux_do_event(&e);
+  e.type = SDL_MOUSEBUTTONUP;
+  e.button.state = SDL_RELEASED;
+  lux_do_event(&e);
+  switching_to = NULL;
+}
+
+static void switcher_key_handler (Window * w, SDL_keysym * k, bool down)
+{
+  if (down && k->sym == SDLK_ESCAPE) switcher_close();
+}
 
-  memset(s, 0, sizeof(*s));
+static void switcher_close_handler (Window * w)
+{
+  switcher_close();
 }
 
+// F2 opens a window with a live thumbnail of every client, and closes it
+// again
+static void f2_handler (FKey * fkey)
+{
+  if (switcher)
+  {
+    switcher_close();
+    return;
+  }
+
+  int n = 0;
+  for (int i = 0; i < num_sessions; i++)
+  {
+    if (switcher_shows(sessions[i])) n++;
+  }
+  if (!n) return;
+
+  int cols = 1;
+  while (cols * cols < n) cols++;
+  int rows = (n + cols - 1) / cols;
+  switcher_cols = cols;
+  switcher = window_create(SDLUX_THUMB_GAP + cols * (SDLUX_THUMB_W + SDLUX_THUMB_GAP),
+                           SDLUX_THUMB_GAP + rows * (SDLUX_THUMB_H + SDLUX_THUMB_GAP),
+                           "Windows", 0);
+  switcher->bg_color = lux_get_theme().win.face;
+  switcher->on_draw = switcher_draw_handler;
+  switcher->on_mousedown = switcher_click_handler;
+  switcher->on_keydown = switcher_key_handler;
+  switcher->on_close = switcher_close_handler;
+  if (!own_window_opened(switcher)) switcher = NULL;
+}
 
 static void sdl_resized_handler (Window * w)
 {
   Session * s = (void *)w->opaque_ptr;
-  if (!s) return;
+  if (!s || !wants_event(s, ResizedEvent)) return;
   OMSG(ResizedEvent, m);
   m->event.type = SDL_VIDEORESIZE;
   SDL_Rect r;
   window_get_client_rect(w, &r);
   m->event.w = r.w;
   m->event.h = r.h;
-  if (!senddata(s->fd, sizeof(*m))) close_session(s->fd);
+  if (!sendevent(s, sizeof(*m))) close_session(s);
 }
 
 static void sdl_raiselower_handler (Window * w, bool raised)
 {
   Session * s = (void *)w->opaque_ptr;
   if (!s) return;
+  if (raised) s->raised = ++raise_count;
+  if (!wants_event(s, ActiveEvent)) return;
   OMSG(ActiveEvent, m);
   m->event.type = SDL_ACTIVEEVENT;
   m->event.gain = raised ? 1 : 0;
   m->event.state = SDL_APPINPUTFOCUS;
-  if (!senddata(s->fd, sizeof(*m))) close_session(s->fd);
+  if (!sendevent(s, sizeof(*m))) close_session(s);
 }
 
 static void sdl_mouseinout_handler (Window * w, bool in)
 {
   Session * s = (void *)w->opaque_ptr;
   if (!s) return;
+  if (!in && overlay.s == s) overlay_move(NULL, 0, 0);
+  if (!wants_event(s, ActiveEvent)) return;
   OMSG(ActiveEvent, m);
   m->event.type = SDL_ACTIVEEVENT;
   m->event.gain = in ? 1 : 0;
   m->event.state = SDL_APPMOUSEFOCUS;
-  if (!senddata(s->fd, sizeof(*m))) close_session(s->fd);
+  if (!sendevent(s, sizeof(*m))) close_session(s);
 }
 
 static void sdl_close_handler (Window * w)
 {
   Session * s = (void *)w->opaque_ptr;
   if (!s) return; // Maybe just close it?
-  OMSG(QuitEvent, msg);
-  senddata(s->fd, sizeof(*msg));
-  close_session(s->fd);
+  if (wants_event(s, QuitEvent))
+  {
+    OMSG(QuitEvent, msg);
+    sendevent(s, sizeof(*msg));
+  }
+  close_session(s);
+}
+
+// Blits the part of r (in window coordinates) which can be seen
+static void blit_visible (Session * s, SDL_Surface * surf, const SDL_Rect * r, SDL_Surface * scr, const SDL_Rect * rect)
+{
+  int num = s->exposed_all ? 1 : s->num_exposed;
+  for (int i = 0; i < num; i++)
+  {
+    SDL_Rect v = *r;
+    if (!s->exposed_all && !rect_intersect(r, &s->exposed[i], &v)) continue;
+    SDL_Rect d = {rect->x + v.x, rect->y + v.y, v.w, v.h};
+    if (blit_rect(surf, &v, scr, &d)) stats.blits_fast++;
+    else stats.blits_slow++;
+  }
 }
 
 static bool sdl_draw_handler (Window * w, SDL_Surface * scr, SDL_Rect rect)
 {
   Session * s = (Session *)w->opaque_ptr;
-  if (!s || !s->surf1) return false;
-  SDL_Rect r = {0,0,rect.w,rect.h};
-  SDL_BlitSurface(s->surf1, &r, scr, &rect);
+  if (!s) return false;
+  SDL_Surface * surf = front_surface(s);
+  if (!surf) return false;
+
+  if (s->hidden)
+  {
+    // Whatever's on top of us will be drawn over this anyway
+    stats.blits_culled++;
+    s->drawn_rect.w = 0; // So the next draw is a full one
+    return true;
+  }
+
+  // We can only get away with redrawing just the damage if what's on the
+  // screen is still what we drew last time.  If we're the top window and
+  // haven't moved, no other client can have drawn over us, but our own
+  // windows might be (or have been) anywhere.
+  bool partial = !s->damage_full && s->num_damage
+              && window_is_top(w)
+              && !num_own_windows && s->drawn_closed == own_windows_closed
+              && rect.x == s->drawn_rect.x && rect.y == s->drawn_rect.y
+              && rect.w == s->drawn_rect.w && rect.h == s->drawn_rect.h;
+
+  if (partial)
+  {
+    for (int i = 0; i < s->num_damage; i++)
+    {
+      SDL_Rect r = s->damage[i];
+      if (r.x >= rect.w || r.y >= rect.h) continue;
+      if (r.x + r.w > rect.w) r.w = rect.w - r.x;
+      if (r.y + r.h > rect.h) r.h = rect.h - r.y;
+      blit_visible(s, surf, &r, scr, &rect);
+    }
+  }
+  else
+  {
+    SDL_Rect r = {0,0,rect.w,rect.h};
+    blit_visible(s, surf, &r, scr, &rect);
+  }
+
+  s->drawn_rect = rect;
+  s->drawn_closed = own_windows_closed;
+  if (!s->exposed_all) s->drawn_rect.w = 0;
+  s->damage_full = false;
+  s->num_damage = 0;
   return true;
 }
 
 static void sdl_key_handler (Window * w, SDL_keysym * k, bool down)
 {
   Session * s = (void *)w->opaque_ptr;
-  if (!s) return;
+  if (!s || !wants_event(s, KeyEvent)) return;
   OMSG(KeyEvent, em);
   SDL_KeyboardEvent * e = &em->event;
   e->type = down ? SDL_KEYDOWN : SDL_KEYUP;
   e->state = down ? SDL_PRESSED : SDL_RELEASED;
   e->keysym = *k;
-  if (!senddata(s->fd, sizeof(*em))) close_session(s->fd);
+  if (!sendevent(s, sizeof(*em))) close_session(s);
 }
 
 static void sdl_mouse_button_handler (Window * w, int x, int y, int button, int type, bool raised)
 {
   Session * s = (void *)w->opaque_ptr;
-  if (!s) return;
+  if (!s || s == switching_to || !wants_event(s, MouseButtonEvent)) return;
   OMSG(MouseButtonEvent, em);
   em->event.type = type;
   em->event.state = (type == SDL_MOUSEBUTTONDOWN) ? SDL_PRESSED : SDL_RELEASED;
   em->event.x = x;
   em->event.y = y;
   em->event.button = button;
-  if (!senddata(s->fd, sizeof(*em))) close_session(s->fd);
+  if (!sendevent(s, sizeof(*em))) close_session(s);
 }
 
 static void sdl_mouse_move_handler (Window * w, int x, int y, int buttons, int dx, int dy)
 {
   Session * s = (void *)w->opaque_ptr;
   if (!s) return;
-  OMSG(MouseMoveEvent, em);
-  em->event.type = SDL_MOUSEMOTION;
-  em->event.state = buttons;
-  em->event.x = x;
-  em->event.y = y;
-  em->event.xrel = dx;
-  em->event.yrel = dy;
+  stats.motion_events++;
   LOG_DEBUG("Mouse move fd:%i pos:%i,%i", s->fd, x, y);
-  if (!senddata(s->fd, sizeof(*em))) close_session(s->fd);
+  overlay_move(s, x, y);
+  if (!wants_event(s, MouseMoveEvent)) return;
+
+  OMSG(MouseMoveEvent, m);
+  memset(m, 0, sizeof(*m));
+  SDL_MouseMotionEvent * e = &m->event;
+  e->type = SDL_MOUSEMOTION;
+  e->state = buttons;
+  e->x = x;
+  e->y = y;
+  e->xrel = dx < -32768 ? -32768 : (dx > 32767 ? 32767 : dx);
+  e->yrel = dy < -32768 ? -32768 : (dy > 32767 ? 32767 : dy);
+
+  // Without an event ring, the I/O thread merges motion until it can be
+  // sent (see merge_motion())
+  if (!ring_push(s, sizeof(*m))) to_io_push(s, CmdMotion, m, sizeof(*m), NULL);
 }
 
 
 
-static bool set_video_mode (int fd, Session * s, Window * w, SetVideoModeMsg * msg, VideoModeSetMsg * out)
+static bool set_video_mode (Session * s, Window * w, SetVideoModeMsg * msg, VideoModeSetMsg * out)
 {
+  if (msg->w <= 0 || msg->h <= 0 || msg->w > SDLUX_MAX_SIZE || msg->h > SDLUX_MAX_SIZE)
+  {
+    LOG_WARN("Bad video mode size %ix%i on fd:%i", msg->w, msg->h, s->fd);
+    return false;
+  }
+
   out->success = true;
   out->w = msg->w;
   out->h = msg->h;
-  out->pitch = out->w * 4;
-  out->depth = 32;
-  out->rmask = rmask;
-  out->gmask = gmask;
-  out->bmask = bmask;
   out->double_buf = msg->double_buf;
-
-  static int mem_id = 0;
-  sprintf(out->name, "/sdluxer_%i_%i", getpid(), mem_id++);
-  int memfd = shm_open(out->name, O_CREAT | O_RDWR | O_EXCL, 0666);
-  if (memfd < 0)
+  int buffers = 1;
+  if (msg->double_buf) buffers = (msg->buffers >= 3) ? 3 : 2;
+  if (msg->depth == 8)
   {
-    LOG_ERROR("Shared memory creation failed");
-    return false;
+    // Paletted; the client sets colors with SetPalette
+    out->depth = 8;
+    out->pitch = (out->w + 3) & ~3;
+    out->rmask = out->gmask = out->bmask = 0;
   }
-
-  s->shmem_name = strdup(out->name);
-
-  int size = msg->w * msg->h * 4;
-  if (out->double_buf) size *= 2;
-
-  if (ftruncate(memfd, size) != 0)
+  else if (msg->depth == 16)
   {
-    LOG_ERROR("ftruncate() failed due to errno:%i", errno);
-    close(memfd);
-    return false;
+    out->depth = 16;
+    out->pitch = (out->w * 2 + 3) & ~3;
+    out->rmask = 0xf800;
+    out->gmask = 0x07e0;
+    out->bmask = 0x001f;
   }
-
-  char * pixels = mmap(NULL, size, PROT_WRITE|PROT_READ, MAP_SHARED, memfd, 0);
-  if (!pixels)
+  else
   {
-    close(memfd);
-    LOG_ERROR("Couldn't map memory");
-    return false;
+    // Anything else, the client has to convert to what the screen uses
+    out->depth = 32;
+    out->pitch = out->w * 4;
+    out->rmask = rmask;
+    out->gmask = gmask;
+    out->bmask = bmask;
   }
 
-  SDL_Surface * ns1 = NULL;
-  SDL_Surface * ns2 = NULL;
-
-  ns1 = SDL_CreateRGBSurfaceFrom(pixels, out->w, out->h, out->depth, out->pitch, out->rmask, out->gmask, out->bmask, 0);
-  if (out->double_buf)
+  size_t size = (size_t)out->pitch * out->h * buffers;
+  bool named = !msg->want_fd;
+  bool reused;
+  if (!shmbuf_reserve(&s->fb, size, named, &reused))
   {
-    ns2 = SDL_CreateRGBSurfaceFrom(pixels + out->pitch * out->h, out->w, out->h, out->depth, out->pitch, out->rmask, out->gmask, out->bmask, 0);
+    LOG_ERROR("Couldn't get %zu bytes of shared memory (errno:%i)", size, errno);
+    return false;
   }
+  if (reused) stats.fb_reused++;
+  else stats.fb_allocated++;
+  if (!reused && s->fb.huge) stats.fb_huge++;
+  strcpy(out->name, named ? s->fb.name : "");
+
+  // The old surfaces may point at memory which is gone now
+  for (int i = 0; i < s->num_buffers; i++) SDL_FreeSurface(s->surfs[i]);
+  memset(s->surfs, 0, sizeof(s->surfs));
+  s->num_buffers = 0;
 
-  if ( (!ns1) || (out->double_buf && (!ns2)) )
+  for (int i = 0; i < buffers; i++)
   {
-    LOG_ERROR("Couldn't create surfaces");
-    if (ns1) SDL_FreeSurface(ns1);
-    if (ns2) SDL_FreeSurface(ns2);
-    close(memfd);
-    return false;
+    s->surfs[i] = SDL_CreateRGBSurfaceFrom(s->fb.mem + i * out->pitch * out->h, out->w, out->h, out->depth, out->pitch, out->rmask, out->gmask, out->bmask, 0);
+    if (!s->surfs[i])
+    {
+      LOG_ERROR("Couldn't create surfaces");
+      for (int j = 0; j < i; j++) SDL_FreeSurface(s->surfs[j]);
+      memset(s->surfs, 0, sizeof(s->surfs));
+      return false;
+    }
   }
 
-  // Whew, that's everything!
-  close(memfd);
-
   if (!w)
   {
     w = window_create(out->w, out->h, "", msg->resizable ? WIN_F_RESIZE : 0);
+    if (!w)
+    {
+      LOG_ERROR("Couldn't create window");
+      for (int i = 0; i < buffers; i++) SDL_FreeSurface(s->surfs[i]);
+      memset(s->surfs, 0, sizeof(s->surfs));
+      return false;
+    }
     w->on_keydown   = sdl_key_handler;
     w->on_keyup     = sdl_key_handler;
     w->on_mousedown = sdl_mouse_button_handler;
@@ -456,62 +2459,122 @@ static bool set_video_mode (int fd, Session * s, Window * w, SetVideoModeMsg * m
     w->on_mouseout  = sdl_mouseinout_handler;
     w->on_resized   = sdl_resized_handler;
     w->opaque_ptr = s;
+    s->raised = ++raise_count; // New windows go on top
     s->wnd = w;
-    if (!w)
+  }
+  else
+  {
+    window_resize(w, out->w, out->h);
+    window_dirty(w);
+  }
+
+  s->num_buffers = buffers;
+  // Start by showing the last buffer so the client draws on one we're not
+  s->front = buffers - 1;
+  s->back = 0;
+  s->pending = -1;
+  s->swap_pending = false;
+  s->mailbox = buffers == 3;
+  damage_all(s);
+
+  LOG_DEBUG("set_video_mode success!");
+  return true;
+}
+
+// The client has finished drawing a frame
+static void submit_frame (Session * s, bool flip)
+{
+  s->draws++;
+  if (!s->draw_time) s->draw_time = stats_now_us();
+
+  if (s->mailbox)
+  {
+    if (s->pending >= 0)
     {
-      LOG_ERROR("Couldn't create window");
-      munmap(pixels, size);
-      if (ns1) SDL_FreeSurface(ns1);
-      if (ns2) SDL_FreeSurface(ns2);
-      return false;
+      stats.frames_dropped++;
+      s->frames_dropped++;
     }
-  }
-  else
-  {
-    window_resize(w, out->w, out->h);
-    window_dirty(w);
-  }
+    s->pending = s->back;
 
-  if (s->surf1) SDL_FreeSurface(s->surf1);
-  if (s->surf2) SDL_FreeSurface(s->surf2);
-  if (s->shmem) munmap(s->shmem, s->shmem_size);
-  if (ns2)
-  {
-    // Start swapped so that client draws on the one we're not showing
-    s->surf2 = ns1;
-    s->surf1 = ns2;
+    // Whichever buffer we're neither showing nor about to show is free
+    for (int i = 0; i < SDLUX_MAX_BUFFERS; i++)
+    {
+      if (i == s->front || i == s->pending) continue;
+      s->back = i;
+      break;
+    }
+
+    if (!send_presented(s, 0))
+    {
+      close_session(s);
+      return;
+    }
   }
   else
   {
-    s->surf1 = ns1;
-    s->surf2 = ns2;
+    if (flip && s->flip_wait)
+    {
+      // The client didn't wait, so the frame it flipped before is gone
+      stats.frames_dropped++;
+      s->frames_dropped++;
+    }
+    s->flip_wait = flip;
+    if (s->num_buffers == 2) s->swap_pending = true;
   }
-  s->shmem = pixels;
-  s->shmem_size = size;
-
-  LOG_DEBUG("set_video_mode success!");
-  return true;
+  queue_draw(s);
 }
 
-void handle_message (int fd, char * buf, int length)
+// Older clients send a SetVideoModeMsg without the fields we've added
+// since.  We have room after every message, so just zero-extend it.
+#define SETVIDEOMODE_V1_SIZE (4 + offsetof(SetVideoModeMsg, depth))
+
+void handle_message (Session * s, char * buf, int length)
 {
-  Session * s = &sessions[fd];
   Window * w = s->wnd;
   int32_t type = -1;
   if (length >= 4) type = *(int32_t*)buf;
   else LOG_ERROR("Message length is only %i", length);
 
+  if (recording)
+  {
+    bool ok = true;
+    if ((type == Draw || type == DrawRects) && s->num_buffers)
+    {
+      // The client drew into the buffer we're not showing (or in mailbox
+      // mode, the one we told it to)
+      int b = s->mailbox ? s->back : (s->num_buffers == 2 ? s->front ^ 1 : 0);
+      SDL_Surface * surf = s->surfs[b];
+      ok = record_frame(s->id, &s->rec_shadow, b, surf->pixels, surf->pitch, surf->w, surf->h, surf->format->BitsPerPixel);
+    }
+    if (!ok || !record_message(s->id, buf, length)) record_failed();
+  }
+
+  if (type == SetVideoMode && length >= SETVIDEOMODE_V1_SIZE && length < 4 + sizeof(SetVideoModeMsg))
+  {
+    memset(buf + length, 0, 4 + sizeof(SetVideoModeMsg) - length);
+    length = 4 + sizeof(SetVideoModeMsg);
+  }
+
   START_HANDLERS
   HANDLE(SetVideoMode)
     OMSG(VideoModeSet, out);
-    if (!set_video_mode(fd, s, w, msg, out))
+    if (!set_video_mode(s, w, msg, out))
     {
       out->success = false;
-      if (!senddata(fd, sizeof(*out))) close_session(fd);
+      if (!senddata(s, sizeof(*out))) close_session(s);
     }
     else
     {
-      if (!senddata(fd, sizeof(*out) + strlen(out->name) + 1)) close_session(fd);
+      bool ok;
+      if (s->fb.name) ok = senddata(s, sizeof(*out) + strlen(out->name) + 1);
+      else ok = senddata_fb_fd(s, sizeof(*out) + 1);
+      if (!ok) close_session(s);
+      else if (s->mailbox)
+      {
+        OMSG(NextBuffer, nb);
+        nb->index = s->back;
+        if (!senddata(s, sizeof(*nb))) close_session(s);
+      }
     }
   HANDLE(WarpMouse)
     if (w && window_is_top(w))
@@ -529,12 +2592,84 @@ void handle_message (int fd, char * buf, int length)
       y += r.y;
       SDL_WarpMouse(x, y);
     }
+  HANDLE(SetEventRing)
+    free_event_ring(s);
+    int size = msg->size > 0 ? msg->size : SDLUX_DEFAULT_EVENT_RING;
+    if (size < 4096) size = 4096;
+    if (size > SDLUX_MAX_EVENT_RING) size = SDLUX_MAX_EVENT_RING;
+    size &= ~7;
+    int fds[SDLUX_MAX_PASS_FDS] = {-1, -1};
+    bool reused;
+    if (!shmbuf_reserve(&s->ring_mem, sizeof(SpscShared) + size, false, &reused))
+    {
+      LOG_ERROR("Couldn't allocate event ring for fd:%i (errno:%i)", s->fd, errno);
+    }
+    else if ((s->ring_bell = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK)) < 0)
+    {
+      LOG_ERROR("Couldn't create eventfd (errno:%i)", errno);
+    }
+    else
+    {
+      memset(s->ring_mem.mem, 0, sizeof(SpscShared));
+      spsc_attach(&s->ring, s->ring_mem.mem, size);
+      fds[0] = fcntl(s->ring_mem.fd, F_DUPFD_CLOEXEC, 0);
+      fds[1] = fcntl(s->ring_bell, F_DUPFD_CLOEXEC, 0);
+    }
+    OMSG(EventRingSet, out);
+    out->success = fds[0] >= 0 && fds[1] >= 0;
+    out->size = out->success ? size : 0;
+    if (out->success)
+    {
+      if (!senddata_fds(s, sizeof(*out), fds)) close_session(s);
+    }
+    else
+    {
+      for (int i = 0; i < SDLUX_MAX_PASS_FDS; i++) if (fds[i] >= 0) close(fds[i]);
+      free_event_ring(s);
+      if (!senddata(s, sizeof(*out))) close_session(s);
+    }
+  HANDLE(SetPresentSync)
+    shmbuf_free(&s->sync_mem);
+    s->sync_seq = 0;
+    OMSG(PresentSyncSet, out);
+    out->success = !msg->enable;
+    int fds[SDLUX_MAX_PASS_FDS] = {-1, -1};
+    bool reused;
+    if (!msg->enable)
+    {
+      // Back to messages
+    }
+    else if (!shmbuf_reserve(&s->sync_mem, sizeof(PresentSyncShared), false, &reused))
+    {
+      LOG_ERROR("Couldn't allocate present sync memory for fd:%i (errno:%i)", s->fd, errno);
+    }
+    else if ((fds[0] = fcntl(s->sync_mem.fd, F_DUPFD_CLOEXEC, 0)) < 0)
+    {
+      LOG_ERROR("Couldn't dup present sync fd (errno:%i)", errno);
+      shmbuf_free(&s->sync_mem);
+    }
+    else
+    {
+      memset(s->sync_mem.mem, 0, sizeof(PresentSyncShared));
+      out->success = true;
+    }
+    bool ok;
+    if (fds[0] >= 0) ok = senddata_fds(s, sizeof(*out), fds);
+    else ok = senddata(s, sizeof(*out));
+    if (!ok) close_session(s);
+  HANDLE(SetEventMask)
+    s->event_mask = msg->mask & SDLUX_EVENT_TYPES;
+    LOG_DEBUG("Event mask for fd:%i is %#x", s->fd, s->event_mask);
   HANDLE(AddCursor)
     int index = -1;
     if (msg->w % 8)
     {
       LOG_WARN("Cursor width isn't multiple of 8");
     }
+    else if (msg->w <= 0 || msg->h <= 0 || msg->w > 256 || msg->h > 256)
+    {
+      LOG_WARN("Bad cursor size %ix%i", msg->w, msg->h);
+    }
     else
     {
       int size = msg->w / 8 * msg->h;
@@ -547,31 +2682,49 @@ void handle_message (int fd, char * buf, int length)
       {
         SDL_Cursor * nc = SDL_CreateCursor(msg->data, msg->data + size, msg->w, msg->h, msg->hotx, msg->hoty);
         if (!nc) LOG_WARN("Couldn't create cursor");
-        // We could look for a "free" spot, but we don't.
-        if (s->cursors == NULL)
-        {
-          s->cursors = malloc(sizeof(SDL_Cursor*));
-        }
-        else
-        {
-          s->cursors = realloc(s->cursors, sizeof(SDL_Cursor*) * (s->num_cursors+1));
-        }
-        if (!s->cursors)
-        {
-          LOG_ERROR("Couldn't allocate cursor memory");
-        }
-        else
-        {
-          s->cursors[s->num_cursors] = nc;
-          index = s->num_cursors;
-          ++s->num_cursors;
-        }
+        index = add_cursor(s, nc, NULL);
       }
     }
 
     OMSG(CursorAdded, out);
     out->index = index;
-    if (!senddata(fd, sizeof(*out))) close_session(fd);
+    if (!senddata(s, sizeof(*out))) close_session(s);
+
+  HANDLE(AddColorCursor)
+    int index = -1;
+    if (msg->w <= 0 || msg->h <= 0 || msg->w > SDLUX_MAX_COLOR_CURSOR || msg->h > SDLUX_MAX_COLOR_CURSOR)
+    {
+      LOG_WARN("Bad color cursor size %ix%i", msg->w, msg->h);
+    }
+    else if (4 + sizeof(*msg) + msg->w * msg->h * 4 > length)
+    {
+      LOG_WARN("Not enough cursor data");
+    }
+    else if (!overlay_screen())
+    {
+      LOG_WARN("Color cursors need a 32 bit screen");
+    }
+    else
+    {
+      ColorCursor * c = malloc(sizeof(ColorCursor) + msg->w * msg->h * 4);
+      if (!c)
+      {
+        LOG_ERROR("Couldn't allocate cursor memory");
+      }
+      else
+      {
+        c->w = msg->w;
+        c->h = msg->h;
+        c->hotx = msg->hotx;
+        c->hoty = msg->hoty;
+        memcpy(c->pixels, msg->data, msg->w * msg->h * 4);
+        index = add_cursor(s, NULL, c);
+      }
+    }
+
+    OMSG(CursorAdded, out);
+    out->index = index;
+    if (!senddata(s, sizeof(*out))) close_session(s);
 
   HANDLE(ManageCursor)
     if (w)
@@ -583,48 +2736,242 @@ void handle_message (int fd, char * buf, int length)
       {
         // Special case
         window_cursor_set(w, NULL);
+        set_color_cursor(s, NULL);
       }
       else if (op == CursorOpShow || op == CursorOpHide)
       {
-        window_cursor_show(w, op == 2);
+        s->cursor_hidden = op == CursorOpHide;
+        set_color_cursor(s, s->color_cursor);
       }
       else if (index >= 0 && index < s->num_cursors)
       {
+        SessionCursor * c = &s->cursors[index];
         if (op == CursorOpSet) // Set
         {
-          window_cursor_set(w, s->cursors[index]);
+          // For a color cursor, this puts back the default underneath ours
+          window_cursor_set(w, c->sdl);
+          set_color_cursor(s, c->color);
         }
         else if (op == CursorOpDel) // Delete
         {
-          if (w->cursor == s->cursors[index]) window_cursor_set(w, NULL);
-          if (s->cursors[index]) SDL_FreeCursor(s->cursors[index]);
-          s->cursors[msg->index] = NULL;
+          if (c->sdl && w->cursor == c->sdl) window_cursor_set(w, NULL);
+          if (c->color && s->color_cursor == c->color) set_color_cursor(s, NULL);
+          free_cursor(c);
         }
       }
     }
   HANDLE(WM_SetCaption)
     if (w) window_set_title(w, msg->caption);
+  HANDLE(SetPalette)
+    if (!s->num_buffers || s->surfs[0]->format->BitsPerPixel != 8)
+    {
+      LOG_WARN("SetPalette on fd:%i without an 8 bit video mode", s->fd);
+    }
+    else if (msg->first < 0 || msg->count < 0 || msg->first + msg->count > 256
+             || 4 + sizeof(*msg) + msg->count * sizeof(SDL_Color) > length)
+    {
+      LOG_WARN("Bad SetPalette range %i+%i on fd:%i", msg->first, msg->count, s->fd);
+      close_session(s);
+    }
+    else
+    {
+      for (int i = 0; i < s->num_buffers; i++)
+      {
+        SDL_SetColors(s->surfs[i], msg->colors, msg->first, msg->count);
+      }
+      // Changing the palette changes every pixel
+      damage_all(s);
+      queue_draw(s);
+    }
   HANDLE(Draw)
     if (!w)
     {
       LOG_WARN("Got a flip request from session with no window!\n");
-      close_session(fd);
+      close_session(s);
+    }
+    else
+    {
+      damage_all(s);
+      submit_frame(s, msg->flip);
+    }
+  HANDLE(DrawRects)
+    if (!w)
+    {
+      LOG_WARN("Got a flip request from session with no window!\n");
+      close_session(s);
+    }
+    else if (msg->version != SDLUX_DRAWRECTS_VERSION)
+    {
+      LOG_WARN("Unsupported DrawRects version:%i on fd:%i\n", msg->version, s->fd);
+      close_session(s);
+    }
+    else if (msg->count < 0 || 4 + sizeof(*msg) + msg->count * sizeof(SDL_Rect) > length)
+    {
+      LOG_WARN("Bad DrawRects count:%i on fd:%i\n", msg->count, s->fd);
+      close_session(s);
     }
     else
     {
-      s->flip_wait = msg->flip;
-      s->do_draw = true;
+      for (int i = 0; i < msg->count; i++)
+      {
+        SDL_Rect * r = &msg->rects[i];
+        damage_add(s, r->x, r->y, r->w, r->h);
+      }
+      submit_frame(s, msg->flip);
     }
   }
   else
   {
-    LOG_WARN("Unrecognized message type:%i on fd:%i\n", type, fd);
-    close_session(fd);
+    LOG_WARN("Unrecognized message type:%i on fd:%i\n", type, s->fd);
+    close_session(s);
+  }
+}
+
+
+
+
+// Handles everything the I/O thread has sent us.  Returns true if there
+// was anything.
+static bool render_receive (void)
+{
+  bool any = false;
+  uint32_t length;
+  Cmd * c;
+  while ((c = spsc_front(&to_render, &length)))
+  {
+    any = true;
+    Session * s = c->s;
+    switch (c->kind)
+    {
+      case CmdOpen: add_session(s); break;
+      case CmdHangup: hangup_session(s); break;
+      case CmdMessage:
+        if (!s->closed) handle_message(s, c->data, c->length);
+        break;
+      default: break;
+    }
+    spsc_pop(&to_render);
   }
+
+  // If the I/O thread ran out of room, it's waiting for us to say there's
+  // some again
+  if (__atomic_exchange_n(&io_waiting_for_room, 0, __ATOMIC_ACQ_REL)) wake(io_wake_fd);
+  return any;
 }
 
+static void print_stats (FILE * f)
+{
+#define STAT(name) fprintf(f, #name " %llu\n", (unsigned long long)stats.name)
+  STAT(frames);
+  STAT(sessions_drawn);
+  STAT(last_sessions_drawn);
+  STAT(wakeups);
+  STAT(timeouts);
+  STAT(queue_waits);
+#define ISTAT(name) fprintf(f, #name " %llu\n", (unsigned long long)stat_get(&io_stats.name))
+  ISTAT(msgs_in);
+  ISTAT(msgs_sent);
+  ISTAT(send_calls);
+  STAT(motion_events);
+  ISTAT(motion_merged);
+  ISTAT(motion_deferred);
+  ISTAT(overflow_closes);
+  ISTAT(read_stalls);
+  fprintf(f, "io_wakeups %llu\n", (unsigned long long)stat_get(&io_stats.wakeups));
+#undef ISTAT
+  STAT(frames_dropped);
+  STAT(fb_allocated);
+  STAT(fb_reused);
+  STAT(blits_fast);
+  STAT(blits_slow);
+  STAT(blits_culled);
+  STAT(frames_delayed);
+  STAT(cursor_draws);
+  STAT(thumb_updates);
+  STAT(thumb_pixels);
+  STAT(ring_events);
+  STAT(ring_bells);
+  STAT(ring_overflows);
+  STAT(events_masked);
+  STAT(sync_presents);
+  STAT(sync_wakes);
+  STAT(fb_huge);
+  STAT(frame_faults);
+#undef STAT
+  struct rusage ru;
+  if (getrusage(RUSAGE_SELF, &ru) == 0)
+  {
+    fprintf(f, "minor_faults %li\n", ru.ru_minflt);
+    fprintf(f, "major_faults %li\n", ru.ru_majflt);
+  }
+  fprintf(f, "frame_interval_ms %i\n", sched.interval);
+  fprintf(f, "sessions %i\n", num_sessions);
+  fprintf(f, "hidden_sessions %i\n", num_hidden);
+  hist_print(f, "frame_time_us", &stats.frame_time);
+  hist_print(f, "draw_latency_us", &stats.draw_latency);
+
+  for (int i = 0; i < num_sessions; i++)
+  {
+    Session * s = sessions[i];
+    char prefix[32];
+    snprintf(prefix, sizeof(prefix), "session.%u.", s->id);
+#define SSTAT(name) fprintf(f, "%s" #name " %llu\n", prefix, (unsigned long long)s->name)
+#define IOSTAT(name) fprintf(f, "%s" #name " %llu\n", prefix, (unsigned long long)stat_get(&s->name))
+#define IOSTAT_INT(name) fprintf(f, "%s" #name " %i\n", prefix, stat_get_int(&s->name))
+    SSTAT(fd);
+    IOSTAT(msgs_in);
+    IOSTAT(bytes_in);
+    IOSTAT(msgs_out);
+    IOSTAT(bytes_out);
+    IOSTAT_INT(oring_bytes);
+    IOSTAT_INT(oring_peak);
+    SSTAT(draws);
+    SSTAT(frames_dropped);
+#undef SSTAT
+#undef IOSTAT
+#undef IOSTAT_INT
+    char name[64];
+    snprintf(name, sizeof(name), "%sdraw_latency_us", prefix);
+    hist_print(f, name, &s->draw_latency);
+  }
+}
 
+// Anyone connecting to the stats socket gets a snapshot of the stats as
+// "key value" lines, and then we hang up.  Nothing is gathered that isn't
+// being counted anyway, so it costs nothing when nobody's looking.
+static void serve_stats (void)
+{
+  while (true)
+  {
+    // Nonblocking, so a reader who isn't reading can't hold up the frame;
+    // a snapshot fits in the socket buffer, and if it doesn't, they lose
+    int fd = accept4(stats_fd, NULL, NULL, SOCK_CLOEXEC | SOCK_NONBLOCK);
+    if (fd < 0)
+    {
+      if (errno == EINTR) continue;
+      return;
+    }
 
+    char * text = NULL;
+    size_t size = 0;
+    FILE * f = open_memstream(&text, &size);
+    if (f)
+    {
+      print_stats(f);
+      fclose(f);
+      size_t off = 0;
+      while (off < size)
+      {
+        ssize_t r = send(fd, text + off, size - off, MSG_NOSIGNAL);
+        if (r < 0 && errno == EINTR) continue;
+        if (r <= 0) break;
+        off += r;
+      }
+      free(text);
+    }
+    close(fd);
+  }
+}
 
 void main_loop ()
 {
@@ -633,109 +2980,134 @@ void main_loop ()
   sigprocmask(0, NULL, &sigmask);
 #endif
 
-  Uint32 start_time = SDL_GetTicks();
-  Uint32 last_time = start_time;
-  Uint32 target_time = start_time;
-  uint64_t num_frames = (uint64_t)0; // Will eventually wrap, but not any time soon
   bool draw_pending = true;
 
-  int idle_count = 0; // Number of frames in a row we've been idle
+  static struct epoll_event events[SDLUX_EPOLL_BATCH];
 
-  while (max_fd > 0 && !quitting)
+  while (listen_fd >= 0 && !quitting)
   {
     bool idle = true;
 
-    while (max_fd > 0 && !quitting)
+    while (listen_fd >= 0 && !quitting)
     {
-      Uint32 now = SDL_GetTicks();
-      if (now < last_time)
+      // Once a held frame is due, it just waits for the next frame like
+      // anything else (rather than us waking up until then)
+      if (held_until && stats_now_us() >= held_until)
       {
-        // Wrapped.  Resync.
-        start_time = now;
-        target_time = now;
+        draw_pending = true;
+        held_until = 0;
       }
-      last_time = now;
-      int delta = target_time - now;
 
-      // Between frames
-      if (delta <= 0 && draw_pending)
+      int delta;
+      if (sched_poll(&sched, draw_pending, &delta))
       {
-        delta = 0;
-        for (int i = 0; i <= max_fd; i++)
+        int drawn = 0;
+        update_visibility();
+        uint64_t frame_start = stats_now_us();
+        Session * s = draw_queue;
+        draw_queue = NULL;
+        Session * held = NULL; // Covered, and not due a frame yet
+        Session * shown = NULL; // Drawn this frame
+        held_until = 0;
+        while (s)
         {
-          if (sessions[i].do_draw)
+          Session * next = s->next_draw;
+          if (s->hidden && frame_start < s->hidden_next_frame)
           {
-            Session * s = sessions+i;
-            if (s->flip_wait)
-            {
-              OMSG(Flipped, fm);
-              if (!senddata(s->fd, sizeof(*fm))) close_session(s->fd);
-            }
-            s->flip_wait = false;
-            s->do_draw = false;
-            if (s->surf1 && s->surf2)
-            {
-              SDL_Surface * tmp = s->surf1;
-              s->surf1 = s->surf2;
-              s->surf2 = tmp;
-            }
-            if (s->wnd)
+            if (!s->frame_held) stats.frames_delayed++;
+            s->frame_held = true;
+            if (!held_until || s->hidden_next_frame < held_until) held_until = s->hidden_next_frame;
+            s->next_draw = held;
+            held = s;
+            s = next;
+            continue;
+          }
+          if (s->hidden) s->hidden_next_frame = frame_start + 1000000 / SDLUX_HIDDEN_FPS;
+          s->frame_held = false;
+          s->next_draw = NULL;
+          s->do_draw = false;
+          ++drawn;
+          s->next_shown = shown;
+          shown = s;
+          if (s->mailbox)
+          {
+            if (s->pending >= 0)
             {
-              window_dirty(s->wnd);
+              s->front = s->pending;
+              s->pending = -1;
             }
           }
+          else if (s->swap_pending)
+          {
+            s->front ^= 1;
+            s->swap_pending = false;
+          }
+          if (s->wnd)
+          {
+            window_dirty(s->wnd);
+          }
+          s = next;
         }
+        draw_queue = held;
+        stats.frames++;
+        stats.sessions_drawn += drawn;
+        stats.last_sessions_drawn = drawn;
+        if (switcher && drawn) window_dirty(switcher);
+        if (drawn) LOG_DEBUG("Frame %llu drew %i sessions", (unsigned long long)stats.frames, drawn);
 
         draw_pending = false;
+        // Only count faults on this thread and the blit workers, not the I/O
+        // thread's, which it takes at the same time
+        struct rusage ru0, ru1;
+        getrusage(RUSAGE_THREAD, &ru0);
+        uint64_t worker_faults = workpool_faults();
+        uint64_t t = stats_now_us();
+        if (overlay_hide()) overlay.dirty = true;
         lux_draw();
-        if (idle_count)
-        {
-          last_time = start_time = now;
-          num_frames = 0;
-        }
-        idle_count = 0;
-        ++num_frames;
-        target_time = num_frames * 1000 / 60 + start_time;
-      }
-      else if (delta <= 0)
-      {
+        overlay_update();
+        uint64_t present_time = stats_now_us();
+        hist_add(&stats.frame_time, present_time - t);
+        getrusage(RUSAGE_THREAD, &ru1);
+        stats.frame_faults += ru1.ru_minflt - ru0.ru_minflt + workpool_faults() - worker_faults;
+        sched_frame_done(&sched);
         delta = 0;
-        last_time = start_time = now;
-        num_frames = 0;
-        idle_count++;
 
-        if (idle_count > (60*10+30*60+10*120))
-        {
-          // We've been idle for 3m10s -- cut rate down to 5 fps
-          target_time = now + 200;
-        }
-        else if (idle_count > (60*10+30*60))
+        // Now that the frames are really on the screen, tell the clients
+        for (s = shown; s; s = s->next_shown)
         {
-          // We've been idle for 70 seconds -- cut rate down to 10 fps
-          target_time = now + 100;
-        }
-        else if (idle_count > 60*10)
-        {
-          // Been idle for 10 seconds -- cut rate down to 30 fps
-          target_time = now + 33;
-        }
-        else
-        {
-          target_time = now + 17;
+          s->frames_shown++;
+          if (s->draw_time)
+          {
+            hist_add(&s->draw_latency, present_time - s->draw_time);
+            hist_add(&stats.draw_latency, present_time - s->draw_time);
+            s->draw_time = 0;
+          }
+          if (s->flip_wait && !send_presented(s, present_time)) close_session(s);
+          else if (s->mailbox && s->sync_mem.mem) sync_shown(s, present_time);
+          s->flip_wait = false;
         }
+      }
 
-        delta = target_time - now;
+      // Don't sleep past when a held frame is due
+      if (held_until)
+      {
+        uint64_t now = stats_now_us();
+        int ms = held_until > now ? (held_until - now + 999) / 1000 : 0;
+        if (delta < 0 || ms < delta) delta = ms;
       }
 
+      // Hand whatever we've queued up (e.g., Flipped) to the I/O thread
+      // before sleeping
+      flush_to_io();
+
   #ifdef NO_PPOLL
-      int count = poll(session_fds, max_fd+1, delta);
+      int count = epoll_wait(epoll_fd, events, SDLUX_EPOLL_BATCH, delta);
   #else
-      struct timespec ts;
-      ts.tv_sec = delta / 1000;
-      ts.tv_nsec = (delta % 1000) * 1000000;
-      int count = ppoll(session_fds, max_fd+1, &ts, &sigmask);
+      int count = epoll_pwait(epoll_fd, events, SDLUX_EPOLL_BATCH, delta, &sigmask);
   #endif
       if (count > 0) idle = false;
+      stats.wakeups++;
+      if (count == 0) stats.timeouts++;
 
       if (count == -1)
       {
@@ -744,86 +3116,26 @@ void main_loop ()
         }
         else
         {
-          LOG_ERROR("poll() failed with errno %i\n", errno);
+          LOG_ERROR("epoll_wait() failed with errno %i\n", errno);
           break;
         }
         continue;
       }
-      for (int i = 0; count; i++)
+      for (int i = 0; i < count; i++)
       {
-        if (session_fds[i].fd < 0) continue;
-        if (session_fds[i].revents == 0) continue;
-        count--;
-        if (i == listen_fd)
-        {
-          LOG_DEBUG("New session arrived");
-          int fd = accept(listen_fd, NULL, NULL);
-          int flags = fcntl(fd, F_GETFL, 0);
-          fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-          new_session(fd);
-        }
-        else
-        {
-          //LOG_DEBUG("Handling session %i (events:0x%08x 0%o)", i, session_fds[i].revents, session_fds[i].revents);
-
-          if (session_fds[i].revents & POLLOUT)
-          {
-            Session * s = sessions+i;
-            while (s->buffered_out)
-            {
-              int r = send(i, s->buffered_out->data, s->buffered_out->size, 0);
-              if (r == s->buffered_out->size)
-              {
-                void * old = s->buffered_out;
-                s->buffered_out = s->buffered_out->next;
-                free(old);
-                if (s->buffered_out == NULL)
-                {
-                  session_fds[i].revents &= ~POLLOUT;
-                }
-              }
-              else if (r == -1 && (errno == EAGAIN || errno == EWOULDBLOCK))
-              {
-                break;
-              }
-              else if (r == -1 && errno == EINTR)
-              {
-                break;
-              }
-              else
-              {
-                LOG_ERROR("Failed delayed send with errno:%i\n", errno);
-                close_session(i);
-              }
-            }
-          }
-
-          if (session_fds[i].revents & POLLIN)
-          {
-            static char buf[1024] = {};
-            int readsize = read(session_fds[i].fd, buf, sizeof(buf)-1);
-            if (readsize > 0)
-            {
-              handle_message(i, buf, readsize);
-            }
-            else
-            {
-              close_session(i);
-            }
-          }
-
-          if (session_fds[i].revents & (POLLERR|POLLHUP|POLLRDHUP))
-          {
-            close_session(i);
-          }
-        }
+        void * p = events[i].data.ptr;
+        if (p == (void *)&wake_marker) clear_wake(render_wake_fd);
+        else if (p == (void *)&stats_marker) serve_stats();
+        // For input_fd, we poll SDL below anyway
       }
 
+      if (render_receive()) idle = false;
+
       break;
     }
 
     if (quitting) break;
-    if (max_fd < 0) break;
+    if (listen_fd < 0) break;
 
     SDL_Event event;
     while (SDL_PollEvent(&event))
@@ -832,6 +3144,13 @@ void main_loop ()
       if (event.type == SDL_QUIT) quitting = true;
       lux_do_event(&event);
     }
+    switcher_raise();
+
+    // The cursor moves without anything under it being redrawn
+    overlay_update();
+
+    // Everything queued by handling messages and events goes out together
+    flush_to_io();
 
     if (!idle) draw_pending = true;
 
@@ -844,6 +3163,20 @@ void main_loop ()
 
 
 
+// Finds the fd SDL reads input from, so we can wait on it
+static int get_input_fd (void)
+{
+#if defined(SDL_VIDEO_DRIVER_X11)
+  SDL_SysWMinfo info;
+  SDL_VERSION(&info.version);
+  if (SDL_GetWMInfo(&info) > 0 && info.subsystem == SDL_SYSWM_X11)
+  {
+    return ConnectionNumber(info.info.x11.display);
+  }
+#endif
+  return -1;
+}
+
 static void unlink_listener (void)
 {
   if (listen_sock_name)
@@ -853,15 +3186,51 @@ static void unlink_listener (void)
     free(listen_sock_name);
     listen_sock_name = NULL;
   }
+  if (stats_sock_name)
+  {
+    unlink(stats_sock_name);
+    free(stats_sock_name);
+    stats_sock_name = NULL;
+  }
+}
+
+static void open_stats_socket (void)
+{
+  stats_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  struct sockaddr_un addr = {};
+  addr.sun_family = AF_UNIX;
+  strncpy(addr.sun_path, stats_sock_name, sizeof(addr.sun_path)-1);
+  if (stats_fd < 0 || bind(stats_fd, (struct sockaddr*)&addr, sizeof(addr)))
+  {
+    LOG_ERROR("Could not bind stats socket '%s' (errno:%i)\n", stats_sock_name, errno);
+    free(stats_sock_name);
+    stats_sock_name = NULL; // It's not ours, so don't unlink it
+    exit(1);
+  }
+  if (listen(stats_fd, 4))
+  {
+    LOG_ERROR("Could not listen on stats socket\n");
+    exit(1);
+  }
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = &stats_marker;
+  if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, stats_fd, &ev))
+  {
+    LOG_ERROR("Could not add stats socket to epoll (errno:%i)\n", errno);
+    exit(1);
+  }
 }
 
 
 sighandler_t old_sigint_handler = NULL;
+// Just has the render thread stop, so the recording (say) gets finished
+// properly.  If that gets stuck, another ^C still works.
 void handle_sigint (int arg)
 {
   quitting = true;
-  unlink_listener();
-  exit(0);
+  wake(render_wake_fd);
+  signal(SIGINT, old_sigint_handler);
 }
 
 int main (int argc, char * argv[])
@@ -869,7 +3238,7 @@ int main (int argc, char * argv[])
   int opt;
   uint32_t def_bg_color = 0x54699e;
   listen_sock_name = strdup("sdluxersock");
-  while ((opt = getopt(argc, argv, "d:n:")) != -1)
+  while ((opt = getopt(argc, argv, "d:n:b:w:r:is:Hupj:R:")) != -1)
   {
     switch (opt)
     {
@@ -880,14 +3249,78 @@ int main (int argc, char * argv[])
         free(listen_sock_name);
         listen_sock_name = strdup(optarg);
         break;
+      case 'b':
+        recv_batch = atoi(optarg);
+        break;
+      case 'r':
+        frame_rate = atoi(optarg);
+        break;
+      case 'i':
+        immediate_present = true;
+        break;
+      case 'H':
+        headless = true;
+        break;
+      case 'u':
+        huge_pages = true;
+        break;
+      case 'p':
+        prefault = true;
+        break;
+      case 'j':
+        blit_threads = atoi(optarg);
+        break;
+      case 'R':
+        free(record_path);
+        record_path = strdup(optarg);
+        break;
+      case 's':
+        free(stats_sock_name);
+        stats_sock_name = strdup(optarg);
+        break;
+      case 'w':
+        out_high_water = ORING_ALIGN(atoi(optarg));
+        if (out_high_water < 1024) out_high_water = 1024;
+        out_ring_size = out_high_water * SDLUX_OUT_RING_FACTOR;
+        break;
     }
   }
   lux_set_bg_color(def_bg_color);
 
-  memset(session_fds, -1, sizeof(session_fds));
+  if (!init_recv())
+  {
+    LOG_ERROR("Could not allocate receive buffers\n");
+    exit(1);
+  }
+
+  epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  io_epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+  if (epoll_fd < 0 || io_epoll_fd < 0)
+  {
+    LOG_ERROR("Could not create epoll instance (errno:%i)\n", errno);
+    exit(1);
+  }
+
+  if (!spsc_init(&to_render, SDLUX_QUEUE_SIZE) || !spsc_init(&to_io, SDLUX_QUEUE_SIZE))
+  {
+    LOG_ERROR("Could not allocate thread queues\n");
+    exit(1);
+  }
+  render_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  io_wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+  struct epoll_event wev = {};
+  wev.events = EPOLLIN;
+  wev.data.ptr = &wake_marker;
+  if (render_wake_fd < 0 || io_wake_fd < 0
+      || epoll_ctl(epoll_fd, EPOLL_CTL_ADD, render_wake_fd, &wev)
+      || epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, io_wake_fd, &wev))
+  {
+    LOG_ERROR("Could not set up thread wakeups (errno:%i)\n", errno);
+    exit(1);
+  }
 
   int fd = socket(AF_UNIX, SOCK_SEQPACKET, 0);
-  max_fd = listen_fd = fd;
+  listen_fd = fd;
   struct sockaddr_un addr = {};
   addr.sun_family = AF_UNIX;
   strncpy(addr.sun_path, listen_sock_name, sizeof(addr.sun_path)-1);
@@ -900,24 +3333,85 @@ int main (int argc, char * argv[])
   int tmp = -1;
   int flags = fcntl(fd, F_GETFL, 0);
   fcntl(fd, F_SETFL, flags | O_NONBLOCK);
-  session_fds[listen_fd].fd = fd;
-  session_fds[listen_fd].events = POLLIN;
   if (listen(listen_fd, 8))
   {
     LOG_ERROR("Could not listen on listening socket\n");
     exit(1);
   }
+  struct epoll_event ev = {};
+  ev.events = EPOLLIN | EPOLLET;
+  ev.data.ptr = NULL; // NULL means the listener
+  if (epoll_ctl(io_epoll_fd, EPOLL_CTL_ADD, listen_fd, &ev))
+  {
+    LOG_ERROR("Could not add listening socket to epoll (errno:%i)\n", errno);
+    exit(1);
+  }
+
+  if (stats_sock_name) open_stats_socket();
+
+  if (record_path)
+  {
+    if (!record_start(record_path))
+    {
+      LOG_ERROR("Could not start recording to '%s' (errno:%i)\n", record_path, errno);
+      exit(1);
+    }
+    recording = true;
+  }
+
+  shmbuf_set_options(huge_pages, prefault);
+  if (!workpool_start(blit_threads)) LOG_WARN("Only got %i blit threads", workpool_threads());
 
   old_sigint_handler = signal(SIGINT, handle_sigint);
 
+  // SDL's dummy driver draws into memory and never shows anything, which is
+  // just what we want for benchmarking on machines without a display.
+  if (headless) setenv("SDL_VIDEODRIVER", "dummy", 1);
+
   SDL_Init(SDL_INIT_VIDEO);
   SDL_EnableUNICODE(1);
 
   lux_init(screen_width, screen_height, NULL);
 
   key_register_fkey(SDLK_F1, KMOD_NONE, f1_handler);
+  key_register_fkey(SDLK_F2, KMOD_NONE, f2_handler);
+
+  sched_init(&sched, frame_rate, immediate_present);
+
+  // SDL reads all pending input whenever we poll it, so a level-triggered
+  // wait on its fd won't miss anything.
+  input_fd = get_input_fd();
+  if (input_fd >= 0)
+  {
+    struct epoll_event iev = {};
+    iev.events = EPOLLIN;
+    iev.data.ptr = &input_marker;
+    if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, input_fd, &iev) == 0)
+    {
+      sched.can_sleep = true;
+    }
+    else
+    {
+      LOG_WARN("Couldn't wait on SDL's input fd; polling instead");
+    }
+  }
+
+  // Signals are for the render thread, so the I/O thread blocks them all
+  sigset_t all, old_mask;
+  sigfillset(&all);
+  pthread_sigmask(SIG_SETMASK, &all, &old_mask);
+  pthread_t io_thread;
+  int err = pthread_create(&io_thread, NULL, io_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &old_mask, NULL);
+  if (err)
+  {
+    LOG_ERROR("Could not start I/O thread (error:%i)\n", err);
+    exit(1);
+  }
 
   main_loop();
 
+  if (recording) record_stop();
+
   return 0;
 }
@@ -4,6 +4,11 @@ typedef struct // CS
   int h;
   bool double_buf;
   bool resizable;
+  // Fields after this point may be missing if the client is old, in which
+  // case they're treated as zero.
+  int depth; // 8 (paletted), 16 (RGB565) or 32; 0 lets the server pick
+  int buffers; // With double_buf, 3 asks for mailbox mode (see NextBufferMsg)
+  bool want_fd; // Pass the memory as an fd rather than by name (see below)
 } SetVideoModeMsg;
 
 typedef struct // CS
@@ -17,6 +22,16 @@ typedef struct // CS
   char caption[0];
 } WM_SetCaptionMsg;
 
+typedef struct // CS - for 8 bit modes
+{
+  int first;
+  int count;
+  SDL_Color colors[0];
+} SetPaletteMsg;
+
+// If the client set want_fd, the memory comes as an fd in SCM_RIGHTS
+// ancillary data on this message.  It's at least pitch*h*buffers bytes, and
+// may be the same memory the last video mode used.
 typedef struct // SC
 {
   bool success;
@@ -28,7 +43,7 @@ typedef struct // SC
   uint32_t rmask;
   uint32_t gmask;
   uint32_t bmask;
-  char name[0];
+  char name[0]; // POSIX shared memory name, or empty if it came as an fd
 } VideoModeSetMsg;
 
 typedef struct // CS - request a flip
@@ -36,9 +51,35 @@ typedef struct // CS - request a flip
   bool flip; // Otherwise, it's just a draw
 } DrawMsg;
 
+// Bump this if the layout of DrawRectsMsg changes
+#define SDLUX_DRAWRECTS_VERSION 1
+
+typedef struct // CS - like Draw, but only the listed rectangles changed
+{
+  int version; // SDLUX_DRAWRECTS_VERSION
+  bool flip; // Otherwise, it's just a draw
+  int count;
+  SDL_Rect rects[0]; // In surface coordinates
+} DrawRectsMsg;
+
+// Servers before these fields were added sent an empty FlippedMsg, so check
+// the length before using them.
 typedef struct // SC - flip done
 {
-} FlippedMsg;
+  uint32_t frame; // How many of this client's frames have been shown
+  uint32_t interval; // How often we're taking frames from this client (us)
+  uint32_t dropped; // Frames replaced before they were shown, so far
+  uint64_t present_time; // When it went on the screen (CLOCK_MONOTONIC, us)
+} __attribute__ ((packed, aligned (4))) FlippedMsg;
+
+// In mailbox mode there are three buffers, and the client never waits for
+// a flip.  Right after VideoModeSet, and in reply to every Draw, the server
+// says which buffer to draw into next.  The server always shows the newest
+// frame it has been sent; frames replaced before being shown are dropped.
+typedef struct // SC - mailbox mode: draw into this buffer next
+{
+  int index; // 0, 1 or 2; buffer i starts i*pitch*h bytes into the memory
+} NextBufferMsg;
 
 typedef struct // SC - SDL event
 {
@@ -76,6 +117,12 @@ typedef struct // CS
   char data[0]; // And the mask
 } AddCursorMsg;
 
+// AddColorCursor uses the same message, but data is w*h 32 bit ARGB pixels
+// (alpha in the top byte), and w needn't be a multiple of 8.  Color cursors
+// are drawn by the server over the screen, and can be up to 64x64.  The
+// reply is a CursorAddedMsg, and the index works with ManageCursor.
+typedef AddCursorMsg AddColorCursorMsg; // CS
+
 typedef struct // CS
 {
   int op; // 0 = set cursor, 1 = del cursor, 2 = show, 3 = hide
@@ -95,6 +142,78 @@ typedef struct // SC
   int index; // -1 on error
 } CursorAddedMsg;
 
+// Rather than sending input events (KeyEvent, MouseButtonEvent,
+// MouseMoveEvent, ResizedEvent, ActiveEvent and QuitEvent) as messages, the
+// server can put them in a ring in shared memory, so that a busy client
+// doesn't make a system call per event.  The reply comes with two fds in
+// SCM_RIGHTS ancillary data: the memory, and an eventfd.  The memory holds
+// a queue in spsc.h's format (an SpscShared, then size bytes of records),
+// and each record is an event message just as it would have come over the
+// socket, type and all.  The eventfd is written when an event goes into an
+// empty ring, so a client which has emptied it (and checked spsc_idle())
+// can wait on the eventfd along with the socket.
+//
+// If the client lets the ring fill up, later events come over the socket
+// again (so they're after the ones in the ring) until it asks for a new
+// ring.  Asking again also replaces the old ring.
+typedef struct // CS
+{
+  int size; // Bytes for records; 0 for the default
+} SetEventRingMsg;
+
+typedef struct // SC
+{
+  bool success;
+  int size;
+} EventRingSetMsg;
+
+// Rather than waiting for Flipped (or, in mailbox mode, NextBuffer) to come
+// over the socket after each Draw, a client can watch a word in shared
+// memory.  The reply comes with the memory as an fd in SCM_RIGHTS
+// ancillary data, laid out as a PresentSyncShared.  Where the server would
+// have sent Flipped or NextBuffer, it sets back and then increments seq
+// instead.  A client which wants to sleep until that happens sets waiting
+// and does a FUTEX_WAIT on seq (it's shared memory, so without
+// FUTEX_PRIVATE_FLAG), and clears waiting when it wakes.  The server only
+// does a FUTEX_WAKE if waiting is set, so a client that's still busy when
+// its frame is shown hears about it without any system calls at all.
+// Mailbox clients still get a NextBuffer message after VideoModeSet.
+//
+// The fields after waiting are as in FlippedMsg, and are set before seq
+// changes.  In mailbox mode, they're updated whenever a frame is shown,
+// which doesn't change seq.
+typedef struct
+{
+  uint32_t seq; // Frames shown (or in mailbox mode, Draws taken) so far
+  int32_t back; // The buffer to draw into next
+  uint32_t waiting; // Set by a client about to sleep on seq
+  uint32_t frame;
+  uint32_t interval;
+  uint32_t dropped;
+  uint64_t present_time;
+} PresentSyncShared;
+
+typedef struct // CS
+{
+  bool enable; // Otherwise, go back to Flipped and NextBuffer messages
+} SetPresentSyncMsg;
+
+typedef struct // SC
+{
+  bool success;
+} PresentSyncSetMsg;
+
+// Clients get every kind of input event (KeyEvent, MouseButtonEvent,
+// MouseMoveEvent, ResizedEvent, ActiveEvent and QuitEvent) unless they say
+// otherwise.  mask is the MsgTypes of the ones it wants; e.g., a client
+// whose app has done SDL_EventState(SDL_MOUSEMOTION, SDL_IGNORE) can leave
+// out MouseMoveEvent, and the server won't send any.  Other bits are
+// ignored.  There's no reply.
+typedef struct // CS
+{
+  uint32_t mask;
+} SetEventMaskMsg;
+
 typedef enum MsgType
 {
   Dummy=0,
@@ -113,4 +232,15 @@ typedef enum MsgType
   AddCursor=4096,
   CursorAdded=8192,
   ManageCursor=16384,
+  DrawRects=32768,
+  SetPalette=65536,
+  NextBuffer=131072,
+  AddColorCursor=262144,
+  SetEventRing=524288,
+  EventRingSet=1048576,
+  SetPresentSync=2097152,
+  PresentSyncSet=4194304,
+  SetEventMask=8388608,
 } MsgType;
+
+#define SDLUX_EVENT_TYPES (KeyEvent | MouseButtonEvent | MouseMoveEvent | ResizedEvent | ActiveEvent | QuitEvent)
@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+#include "shmbuf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+static bool use_huge = false;
+static bool use_prefault = false;
+
+void shmbuf_set_options (bool huge, bool prefault)
+{
+  use_huge = huge;
+  use_prefault = prefault;
+}
+
+void shmbuf_init (ShmBuf * b)
+{
+  memset(b, 0, sizeof(*b));
+  b->fd = -1;
+}
+
+void shmbuf_free (ShmBuf * b)
+{
+  if (b->mem) munmap(b->mem, b->size);
+  if (b->fd >= 0) close(b->fd);
+  if (b->name)
+  {
+    shm_unlink(b->name);
+    free(b->name);
+  }
+  shmbuf_init(b);
+}
+
+// Leave room to grow by a quarter, so that resizing a window a bit at a
+// time doesn't need new memory at every step.  Pages which are never
+// touched cost nothing (unless we prefault them).
+static size_t padded_size (size_t size, size_t page)
+{
+  size += size / 4;
+  return (size + page - 1) / page * page;
+}
+
+// Creates and maps new memory in nb
+static bool shmbuf_create (ShmBuf * nb, size_t size, bool named, bool huge)
+{
+  size_t page = sysconf(_SC_PAGESIZE);
+
+  if (named)
+  {
+    static int mem_id = 0;
+    char name[64];
+    snprintf(name, sizeof(name), "/sdluxer_%i_%i", getpid(), mem_id++);
+    nb->fd = shm_open(name, O_CREAT | O_RDWR | O_EXCL | O_CLOEXEC, 0666);
+    if (nb->fd >= 0) nb->name = strdup(name);
+    if (nb->fd >= 0 && !nb->name)
+    {
+      shm_unlink(name);
+      errno = ENOMEM;
+      return false;
+    }
+  }
+  else
+  {
+    nb->fd = memfd_create("sdluxer", MFD_CLOEXEC | (huge ? MFD_HUGETLB : 0));
+  }
+  if (nb->fd < 0) return false;
+
+  if (huge)
+  {
+    // Sizes have to be in whole huge pages
+    struct stat st;
+    if (fstat(nb->fd, &st) != 0) return false;
+    page = st.st_blksize;
+    nb->huge = true;
+  }
+
+  size_t want = padded_size(size, page);
+  if (ftruncate(nb->fd, want) != 0) return false;
+
+  int flags = MAP_SHARED | (use_prefault ? MAP_POPULATE : 0);
+  nb->mem = mmap(NULL, want, PROT_WRITE|PROT_READ, flags, nb->fd, 0);
+  if (nb->mem == MAP_FAILED)
+  {
+    nb->mem = NULL;
+    return false;
+  }
+  nb->size = want;
+
+  // Just a hint, and it's fine if the kernel doesn't take it
+  if (use_huge && !huge) madvise(nb->mem, want, MADV_HUGEPAGE);
+  return true;
+}
+
+bool shmbuf_reserve (ShmBuf * b, size_t size, bool named, bool * reused)
+{
+  *reused = false;
+  if (b->mem && (b->name != NULL) == named && size <= b->size && size >= b->size / 4)
+  {
+    *reused = true;
+    return true;
+  }
+
+  ShmBuf nb;
+  shmbuf_init(&nb);
+
+  // Explicit huge pages only come from a pool the administrator sets up,
+  // which may be empty or too small, in which case we go without.  They're
+  // not worth it for small windows, since each one costs a whole page.
+  bool ok = false;
+  if (use_huge && !named && size >= 2*1024*1024)
+  {
+    ok = shmbuf_create(&nb, size, named, true);
+    if (!ok) shmbuf_free(&nb);
+  }
+  if (!ok) ok = shmbuf_create(&nb, size, named, false);
+  if (!ok)
+  {
+    int e = errno;
+    shmbuf_free(&nb);
+    errno = e;
+    return false;
+  }
+
+  shmbuf_free(b);
+  *b = nb;
+  return true;
+}
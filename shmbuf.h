@@ -0,0 +1,40 @@
+#ifndef SDLUXER_SHMBUF_H
+#define SDLUXER_SHMBUF_H
+
+#include <stdbool.h>
+#include <stddef.h>
+
+// Shared memory holding a session's framebuffers.  It's kept across video
+// mode changes and reused whenever the new mode fits, so a window being
+// dragged bigger and smaller doesn't get a new mapping (and a new round of
+// page faults) every time.
+//
+// Clients which can take a file descriptor get a memfd.  Older ones get
+// named POSIX shared memory, which they open by name.
+typedef struct ShmBuf
+{
+  int fd; // -1 if there's no memory yet
+  char * name; // Named memory only; NULL for a memfd
+  char * mem;
+  size_t size; // How much is mapped, which may be more than was asked for
+  bool huge; // Backed by explicit huge pages
+} ShmBuf;
+
+// With huge, memfds big enough to be worth it are backed by huge pages
+// (MFD_HUGETLB) if the system has any to spare, and transparent huge pages
+// are requested for everything else.  With prefault, new memory is faulted
+// in when it's mapped (MAP_POPULATE) rather than during compositing.
+void shmbuf_set_options (bool huge, bool prefault);
+
+void shmbuf_init (ShmBuf * b);
+
+// Makes sure there are at least size bytes, reusing what's already there
+// if it's big enough (but not far too big) and of the right kind.  Sets
+// *reused accordingly.  On failure, returns false with errno set, and the
+// old memory (if any) is left alone.
+bool shmbuf_reserve (ShmBuf * b, size_t size, bool named, bool * reused);
+
+// Unmaps, closes and (if named) unlinks
+void shmbuf_free (ShmBuf * b);
+
+#endif
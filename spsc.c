@@ -0,0 +1,118 @@
+#include "spsc.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+// Each record is preceded by its length, and padded so the next one is
+// aligned.  A length of SPSC_WRAP means the rest of the buffer is unused.
+#define SPSC_HEADER 8
+#define SPSC_ALIGN(n) (((n) + 7) & ~7u)
+#define SPSC_WRAP 0xffffffffu
+
+bool spsc_init (Spsc * q, uint32_t size)
+{
+  size = SPSC_ALIGN(size);
+  void * mem = aligned_alloc(sizeof(SpscShared), sizeof(SpscShared) + size);
+  if (!mem) return false;
+  memset(mem, 0, sizeof(SpscShared));
+  spsc_attach(q, mem, size);
+  return true;
+}
+
+void spsc_attach (Spsc * q, void * mem, uint32_t size)
+{
+  q->sh = mem;
+  q->buf = (char *)mem + sizeof(SpscShared);
+  q->size = size;
+  q->head = __atomic_load_n(&q->sh->head, __ATOMIC_ACQUIRE);
+  q->tail = __atomic_load_n(&q->sh->tail, __ATOMIC_ACQUIRE);
+  q->res_at = q->res_len = 0;
+}
+
+void * spsc_reserve (Spsc * q, uint32_t length)
+{
+  uint32_t rec = SPSC_HEADER + SPSC_ALIGN(length);
+  uint32_t t = q->tail;
+  uint32_t h = __atomic_load_n(&q->sh->head, __ATOMIC_ACQUIRE);
+  if (h >= q->size || h % 8) return NULL; // Can only be a broken consumer
+
+  // The tail can never catch up to the head, since then the queue would
+  // look empty, so there's always at least some space between them.
+  uint32_t at;
+  if (t >= h)
+  {
+    if (t + rec < q->size || (t + rec == q->size && h != 0))
+    {
+      at = t;
+    }
+    else if (rec < h)
+    {
+      *(uint32_t *)(q->buf + t) = SPSC_WRAP;
+      at = 0;
+    }
+    else
+    {
+      return NULL;
+    }
+  }
+  else if (t + rec < h)
+  {
+    at = t;
+  }
+  else
+  {
+    return NULL;
+  }
+
+  q->res_at = at;
+  q->res_len = length;
+  return q->buf + at + SPSC_HEADER;
+}
+
+void spsc_commit (Spsc * q)
+{
+  *(uint32_t *)(q->buf + q->res_at) = q->res_len;
+  uint32_t t = q->res_at + SPSC_HEADER + SPSC_ALIGN(q->res_len);
+  if (t == q->size) t = 0;
+  q->tail = t;
+  __atomic_store_n(&q->sh->tail, t, __ATOMIC_RELEASE);
+}
+
+bool spsc_commit_notify (Spsc * q)
+{
+  uint32_t was = q->tail;
+  spsc_commit(q);
+  // Pairs with the fence in spsc_idle(): either we see the consumer caught
+  // up, or it sees this record.
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return __atomic_load_n(&q->sh->head, __ATOMIC_RELAXED) == was;
+}
+
+void * spsc_front (Spsc * q, uint32_t * length)
+{
+  uint32_t h = q->head;
+  if (h == __atomic_load_n(&q->sh->tail, __ATOMIC_ACQUIRE)) return NULL;
+  if (*(uint32_t *)(q->buf + h) == SPSC_WRAP)
+  {
+    h = q->head = 0;
+    __atomic_store_n(&q->sh->head, 0, __ATOMIC_RELEASE);
+  }
+  *length = *(uint32_t *)(q->buf + h);
+  return q->buf + h + SPSC_HEADER;
+}
+
+void spsc_pop (Spsc * q)
+{
+  uint32_t h = q->head;
+  uint32_t rec = SPSC_HEADER + SPSC_ALIGN(*(uint32_t *)(q->buf + h));
+  h += rec;
+  if (h == q->size) h = 0;
+  q->head = h;
+  __atomic_store_n(&q->sh->head, h, __ATOMIC_RELEASE);
+}
+
+bool spsc_idle (Spsc * q)
+{
+  __atomic_thread_fence(__ATOMIC_SEQ_CST);
+  return q->head == __atomic_load_n(&q->sh->tail, __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,61 @@
+#ifndef SDLUXER_SPSC_H
+#define SDLUXER_SPSC_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A lock-free queue of variable-sized records, for exactly one producer
+// thread and one consumer thread.  Records are contiguous (they never wrap
+// around the end of the buffer), so they can be used in place.
+//
+// The queue can also live in memory shared with another process, in which
+// case each side has its own Spsc attached to it (see spsc_attach()).
+
+// What the two sides share.  The records follow it.
+typedef struct SpscShared
+{
+  uint32_t head; // Next record to read; written by the consumer
+  uint32_t tail __attribute__ ((aligned (64))); // Where the next record goes; written by the producer
+} __attribute__ ((aligned (64))) SpscShared;
+
+typedef struct Spsc
+{
+  SpscShared * sh;
+  char * buf;
+  uint32_t size;
+  uint32_t head; // Consumer only: its own copy of sh->head
+  uint32_t tail; // Producer only: its own copy of sh->tail
+
+  // Producer only: what spsc_reserve() set aside
+  uint32_t res_at;
+  uint32_t res_len;
+} Spsc;
+
+bool spsc_init (Spsc * q, uint32_t size);
+
+// Uses a queue at mem, which holds an SpscShared followed by size bytes
+// (a multiple of 8) for records.  Memory which is all zero is an empty
+// queue.  The producer never trusts anything the consumer wrote there, so
+// a misbehaving consumer can only make the queue look full.
+void spsc_attach (Spsc * q, void * mem, uint32_t size);
+
+// Producer: returns space for a record of length bytes, or NULL if there
+// isn't room right now.  Nothing is visible to the consumer until
+// spsc_commit().
+void * spsc_reserve (Spsc * q, uint32_t length);
+void spsc_commit (Spsc * q);
+
+// Like spsc_commit(), but returns true if the queue was empty beforehand,
+// in which case a consumer which waits with spsc_idle() needs waking.
+bool spsc_commit_notify (Spsc * q);
+
+// Consumer: returns the oldest record (and its length), or NULL if the
+// queue is empty.  It stays valid until spsc_pop().
+void * spsc_front (Spsc * q, uint32_t * length);
+void spsc_pop (Spsc * q);
+
+// Consumer: true if the queue is empty, in such a way that the producer's
+// next spsc_commit_notify() is sure to see it.  Check this before sleeping.
+bool spsc_idle (Spsc * q);
+
+#endif
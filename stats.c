@@ -0,0 +1,64 @@
+#include "stats.h"
+#include <time.h>
+
+// Values below 4 get a bucket each.  After that, the bucket comes from the
+// position of the top bit and the two bits below it.
+static int hist_bucket (uint64_t v)
+{
+  if (v < 4) return v;
+  int e = 63 - __builtin_clzll(v);
+  return 4 + (e - 2) * 4 + ((v >> (e - 2)) & 3);
+}
+
+// The largest value which goes in bucket b
+static uint64_t hist_bucket_top (int b)
+{
+  if (b < 4) return b;
+  int e = (b - 4) / 4 + 2;
+  uint64_t low = (uint64_t)(4 | ((b - 4) & 3)) << (e - 2);
+  return low + ((uint64_t)1 << (e - 2)) - 1;
+}
+
+void hist_add (Histogram * h, uint64_t value)
+{
+  h->buckets[hist_bucket(value)]++;
+  h->count++;
+  h->sum += value;
+  if (value > h->max) h->max = value;
+}
+
+uint64_t hist_percentile (const Histogram * h, double p)
+{
+  if (!h->count) return 0;
+  uint64_t want = (uint64_t)(h->count * p / 100.0);
+  if (want >= h->count) want = h->count - 1;
+  uint64_t seen = 0;
+  for (int i = 0; i < HIST_BUCKETS; i++)
+  {
+    seen += h->buckets[i];
+    if (seen > want)
+    {
+      // Report the top of the bucket, but never more than we've seen
+      uint64_t top = hist_bucket_top(i);
+      return top < h->max ? top : h->max;
+    }
+  }
+  return h->max;
+}
+
+void hist_print (FILE * f, const char * name, const Histogram * h)
+{
+  fprintf(f, "%s_count %llu\n", name, (unsigned long long)h->count);
+  fprintf(f, "%s_sum %llu\n", name, (unsigned long long)h->sum);
+  fprintf(f, "%s_max %llu\n", name, (unsigned long long)h->max);
+  fprintf(f, "%s_p50 %llu\n", name, (unsigned long long)hist_percentile(h, 50));
+  fprintf(f, "%s_p90 %llu\n", name, (unsigned long long)hist_percentile(h, 90));
+  fprintf(f, "%s_p99 %llu\n", name, (unsigned long long)hist_percentile(h, 99));
+}
+
+uint64_t stats_now_us (void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
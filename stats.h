@@ -0,0 +1,32 @@
+#ifndef SDLUXER_STATS_H
+#define SDLUXER_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+// A histogram with logarithmic buckets: each power of two is split into
+// four, so values are known to within 25%.  Adding to one is just a few
+// instructions, so they're always on.
+#define HIST_BUCKETS (4 + 62 * 4)
+
+typedef struct Histogram
+{
+  uint64_t count;
+  uint64_t sum;
+  uint64_t max;
+  uint64_t buckets[HIST_BUCKETS];
+} Histogram;
+
+void hist_add (Histogram * h, uint64_t value);
+
+// Approximate value at percentile p (0-100)
+uint64_t hist_percentile (const Histogram * h, double p);
+
+// Writes name_count, name_sum, name_max, name_p50, name_p90 and name_p99
+// lines in the same "key value" format as print_stats() in sdluxer.c.
+void hist_print (FILE * f, const char * name, const Histogram * h);
+
+// Microseconds on the monotonic clock
+uint64_t stats_now_us (void);
+
+#endif
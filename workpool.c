@@ -0,0 +1,121 @@
+#define _GNU_SOURCE
+#include "workpool.h"
+
+#include <pthread.h>
+#include <sys/resource.h>
+
+static int num_threads = 1;
+
+// Page faults the workers have taken doing jobs (see workpool_faults())
+static uint64_t worker_faults;
+static __thread bool is_worker;
+static __thread long last_minflt;
+
+static pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t work_cond = PTHREAD_COND_INITIALIZER; // New job
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER; // Job finished
+
+// The current job.  Parts are handed out under the lock, so a worker that
+// wakes up late can't pick up part of a later job thinking it's this one.
+static unsigned int job_id = 0;
+static WorkFn job_fn;
+static void * job_arg;
+static int job_parts;
+static int job_next; // Next part to hand out
+static int job_done; // Parts finished
+
+// Adds the faults this worker has taken since it last looked
+static void count_faults (void)
+{
+  struct rusage ru;
+  if (getrusage(RUSAGE_THREAD, &ru)) return;
+  __atomic_add_fetch(&worker_faults, ru.ru_minflt - last_minflt, __ATOMIC_RELAXED);
+  last_minflt = ru.ru_minflt;
+}
+
+// Does parts of job id until there are none left
+static void work_on (unsigned int id)
+{
+  pthread_mutex_lock(&lock);
+  while (job_id == id && job_next < job_parts)
+  {
+    int part = job_next++;
+    WorkFn fn = job_fn;
+    void * arg = job_arg;
+    int parts = job_parts;
+    pthread_mutex_unlock(&lock);
+
+    fn(arg, part, parts);
+    // Before the part is marked done, so the caller sees it
+    if (is_worker) count_faults();
+
+    pthread_mutex_lock(&lock);
+    if (++job_done == job_parts) pthread_cond_signal(&done_cond);
+  }
+  pthread_mutex_unlock(&lock);
+}
+
+static void * worker (void * unused)
+{
+  unsigned int seen = 0;
+  is_worker = true;
+  struct rusage ru; // Starting up doesn't count
+  if (!getrusage(RUSAGE_THREAD, &ru)) last_minflt = ru.ru_minflt;
+  while (true)
+  {
+    pthread_mutex_lock(&lock);
+    while (job_id == seen) pthread_cond_wait(&work_cond, &lock);
+    seen = job_id;
+    pthread_mutex_unlock(&lock);
+    work_on(seen);
+  }
+  return NULL;
+}
+
+bool workpool_start (int threads)
+{
+  if (threads <= 1) return true;
+  for (int i = 1; i < threads; i++)
+  {
+    pthread_t t;
+    if (pthread_create(&t, NULL, worker, NULL) != 0) return false;
+    pthread_detach(t);
+    num_threads++;
+  }
+  return true;
+}
+
+int workpool_threads (void)
+{
+  return num_threads;
+}
+
+uint64_t workpool_faults (void)
+{
+  return __atomic_load_n(&worker_faults, __ATOMIC_RELAXED);
+}
+
+void workpool_run (WorkFn fn, void * arg, int parts)
+{
+  if (num_threads <= 1 || parts <= 1)
+  {
+    for (int i = 0; i < parts; i++) fn(arg, i, parts);
+    return;
+  }
+
+  pthread_mutex_lock(&lock);
+  unsigned int id = ++job_id;
+  job_fn = fn;
+  job_arg = arg;
+  job_parts = parts;
+  job_next = 0;
+  job_done = 0;
+  pthread_cond_broadcast(&work_cond);
+  pthread_mutex_unlock(&lock);
+
+  work_on(id);
+
+  pthread_mutex_lock(&lock);
+  while (job_done < job_parts) pthread_cond_wait(&done_cond, &lock);
+  pthread_mutex_unlock(&lock);
+}
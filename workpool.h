@@ -0,0 +1,29 @@
+#ifndef SDLUXER_WORKPOOL_H
+#define SDLUXER_WORKPOOL_H
+
+#include <stdbool.h>
+#include <stdint.h>
+
+// A fixed set of worker threads for splitting up work which has to be
+// finished before the caller can carry on, like one big blit.  There's
+// only the one pool, and only one thread may hand it work.
+
+// Called once for each part; parts are numbered from 0
+typedef void (*WorkFn) (void * arg, int part, int parts);
+
+// Starts threads-1 workers (the calling thread is the last one).  With
+// threads <= 1 there's no pool, and workpool_run() does everything itself.
+bool workpool_start (int threads);
+
+// How many threads work gets split across (1 if there's no pool)
+int workpool_threads (void);
+
+// Runs fn for each of parts parts, spread over the pool and the calling
+// thread, and returns once they've all finished.
+void workpool_run (WorkFn fn, void * arg, int parts);
+
+// Minor page faults the workers (not the calling thread) have taken in
+// workpool_run(), so far
+uint64_t workpool_faults (void);
+
+#endif